@@ -0,0 +1,247 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : clusterbitmap.c                                                  */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Free cluster bitmap                                              */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include "common.h"
+#include "clusterbitmap.h"
+
+#define WORD_INDEX( bit )		( ( bit ) / BITS_PER_WORD )
+#define BIT_MASK( bit )			( 1U << ( ( bit ) % BITS_PER_WORD ) )
+
+/* all clusters start as used, the mount scan frees the ones the FAT says are free */
+int init_cluster_bitmap( CLUSTER_BITMAP* bitmap, UINT32 clusters )
+{
+	ZeroMemory( bitmap, sizeof( CLUSTER_BITMAP ) );
+
+	bitmap->clusters	= clusters;
+	bitmap->words		= ( clusters + BITS_PER_WORD - 1 ) / BITS_PER_WORD;
+	bitmap->map			= ( UINT32* )calloc( bitmap->words + 1, sizeof( UINT32 ) );
+	bitmap->summary		= ( UINT32* )calloc( WORD_INDEX( bitmap->words ) + 1, sizeof( UINT32 ) );
+
+	if( bitmap->map == NULL || bitmap->summary == NULL )
+	{
+		release_cluster_bitmap( bitmap );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+int set_cluster_free( CLUSTER_BITMAP* bitmap, SECTOR cluster )
+{
+	UINT32	word = WORD_INDEX( cluster );
+
+	if( cluster >= bitmap->clusters || ( bitmap->map[word] & BIT_MASK( cluster ) ) )
+		return FAT_ERROR;
+
+	bitmap->map[word] |= BIT_MASK( cluster );
+	bitmap->summary[WORD_INDEX( word )] |= BIT_MASK( word );
+	bitmap->count++;
+
+	return FAT_SUCCESS;
+}
+
+int set_cluster_used( CLUSTER_BITMAP* bitmap, SECTOR cluster )
+{
+	UINT32	word = WORD_INDEX( cluster );
+
+	if( cluster >= bitmap->clusters || !( bitmap->map[word] & BIT_MASK( cluster ) ) )
+		return FAT_ERROR;
+
+	bitmap->map[word] &= ~BIT_MASK( cluster );
+	if( bitmap->map[word] == 0 )
+		bitmap->summary[WORD_INDEX( word )] &= ~BIT_MASK( word );
+	bitmap->count--;
+
+	return FAT_SUCCESS;
+}
+
+/* marks the clusters set in mask free, all of them in one word of the map */
+void set_cluster_word_free( CLUSTER_BITMAP* bitmap, UINT32 word, UINT32 mask )
+{
+	mask &= ~bitmap->map[word];
+	if( mask == 0 )
+		return;
+
+	bitmap->map[word] |= mask;
+	bitmap->summary[WORD_INDEX( word )] |= BIT_MASK( word );
+	bitmap->count += __builtin_popcount( mask );
+}
+
+int is_cluster_free( const CLUSTER_BITMAP* bitmap, SECTOR cluster )
+{
+	if( cluster >= bitmap->clusters )
+		return 0;
+
+	return ( bitmap->map[WORD_INDEX( cluster )] & BIT_MASK( cluster ) ) != 0;
+}
+
+/* lowest free cluster in [from, clusters), the summary finds the next word that is not full */
+int find_free_cluster_from( const CLUSTER_BITMAP* bitmap, SECTOR from, SECTOR* cluster )
+{
+	UINT32	word, bits, summary;
+
+	if( from >= bitmap->clusters )
+		return FAT_ERROR;
+
+	word = WORD_INDEX( from );
+	bits = bitmap->map[word] & ~( BIT_MASK( from ) - 1 );
+
+	while( bits == 0 )
+	{
+		word++;
+		if( word >= bitmap->words )
+			return FAT_ERROR;
+
+		summary = bitmap->summary[WORD_INDEX( word )] & ~( BIT_MASK( word ) - 1 );
+		while( summary == 0 )
+		{
+			word = ( WORD_INDEX( word ) + 1 ) * BITS_PER_WORD;
+			if( word >= bitmap->words )
+				return FAT_ERROR;
+			summary = bitmap->summary[WORD_INDEX( word )];
+		}
+
+		word = WORD_INDEX( word ) * BITS_PER_WORD + __builtin_ctz( summary );
+		bits = bitmap->map[word];
+	}
+
+	*cluster = word * BITS_PER_WORD + __builtin_ctz( bits );
+
+	return *cluster < bitmap->clusters ? FAT_SUCCESS : FAT_ERROR;
+}
+
+/* next free cluster at or after from, wrapping around to the start of the map */
+int find_free_cluster( const CLUSTER_BITMAP* bitmap, SECTOR from, SECTOR* cluster )
+{
+	if( bitmap->count == 0 )
+		return FAT_ERROR;
+
+	if( find_free_cluster_from( bitmap, from, cluster ) == FAT_SUCCESS )
+		return FAT_SUCCESS;
+
+	return find_free_cluster_from( bitmap, 0, cluster );
+}
+
+/* length of the run of free clusters starting at cluster, counting at most max */
+UINT32 count_free_run( const CLUSTER_BITMAP* bitmap, SECTOR cluster, UINT32 max )
+{
+	UINT32	length = 0, word, used;
+
+	while( length < max && cluster < bitmap->clusters )
+	{
+		word = WORD_INDEX( cluster );
+		used = ~bitmap->map[word] & ~( BIT_MASK( cluster ) - 1 );
+
+		if( used )
+		{
+			length += word * BITS_PER_WORD + __builtin_ctz( used ) - cluster;
+			break;
+		}
+
+		length += BITS_PER_WORD - cluster % BITS_PER_WORD;
+		cluster = ( word + 1 ) * BITS_PER_WORD;
+	}
+
+	return length < max ? length : max;
+}
+
+/* Next-fit search for a run of wanted free clusters starting at from and wrapping around.
+ * When no run is long enough the longest one is returned, 0 when nothing is free */
+UINT32 find_free_run( const CLUSTER_BITMAP* bitmap, SECTOR from, UINT32 wanted, SECTOR* first )
+{
+	SECTOR	cluster = from, start;
+	UINT32	length, best = 0;
+	BYTE	wrapped = 0;
+
+	if( bitmap->count == 0 || wanted == 0 )
+		return 0;
+
+	while( 1 )
+	{
+		if( find_free_cluster_from( bitmap, cluster, &start ) == FAT_ERROR )
+		{
+			if( wrapped || from == 0 )
+				break;
+			wrapped = 1;
+			cluster = 0;
+			continue;
+		}
+
+		if( wrapped && start >= from )
+			break;
+
+		length = count_free_run( bitmap, start, wanted );
+		if( length > best )
+		{
+			best	= length;
+			*first	= start;
+		}
+
+		if( length >= wanted )
+			break;
+
+		cluster = start + length;
+	}
+
+	return best;
+}
+
+int set_clusters_used( CLUSTER_BITMAP* bitmap, SECTOR first, UINT32 count )
+{
+	int		result = FAT_SUCCESS;
+
+	while( count-- )
+	{
+		if( set_cluster_used( bitmap, first++ ) )
+			result = FAT_ERROR;
+	}
+
+	return result;
+}
+
+/* Free a run of clusters a word at a time. Returns how many of them were used */
+UINT32 set_clusters_free( CLUSTER_BITMAP* bitmap, SECTOR first, UINT32 count )
+{
+	UINT32	freeCount = bitmap->count;
+	UINT32	bits, shift;
+
+	if( first >= bitmap->clusters )
+		return 0;
+	if( count > bitmap->clusters - first )
+		count = bitmap->clusters - first;
+
+	while( count )
+	{
+		shift	= first % BITS_PER_WORD;
+		bits	= BITS_PER_WORD - shift;
+		if( bits > count )
+			bits = count;
+
+		set_cluster_word_free( bitmap, WORD_INDEX( first ),
+			( bits == BITS_PER_WORD ? ~0U : ( 1U << bits ) - 1 ) << shift );
+		first += bits;
+		count -= bits;
+	}
+
+	return bitmap->count - freeCount;
+}
+
+void release_cluster_bitmap( CLUSTER_BITMAP* bitmap )
+{
+	free( bitmap->map );
+	free( bitmap->summary );
+
+	bitmap->map		= NULL;
+	bitmap->summary	= NULL;
+	bitmap->count	= 0;
+}
+
@@ -0,0 +1,44 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : clusterbitmap.h                                                  */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Free cluster bitmap header                                       */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _CLUSTERBITMAP_H_
+#define _CLUSTERBITMAP_H_
+
+#include "common.h"
+
+#define BITS_PER_WORD		32
+
+/* one bit per cluster, set when the cluster is free. A summary bit is set for every
+ * word of the map that still has a free cluster, so full words are skipped 32 at a time */
+typedef struct
+{
+	UINT32				count;			/* free clusters */
+	UINT32				clusters;		/* clusters covered by the map */
+	UINT32				words;
+	UINT32				hint;			/* next-fit position */
+	UINT32*				map;
+	UINT32*				summary;
+} CLUSTER_BITMAP;
+
+int		init_cluster_bitmap( CLUSTER_BITMAP*, UINT32 );
+int		set_cluster_free( CLUSTER_BITMAP*, SECTOR );
+int		set_cluster_used( CLUSTER_BITMAP*, SECTOR );
+void	set_cluster_word_free( CLUSTER_BITMAP*, UINT32, UINT32 );
+int		is_cluster_free( const CLUSTER_BITMAP*, SECTOR );
+int		find_free_cluster( const CLUSTER_BITMAP*, SECTOR, SECTOR* );
+UINT32	count_free_run( const CLUSTER_BITMAP*, SECTOR, UINT32 );
+UINT32	find_free_run( const CLUSTER_BITMAP*, SECTOR, UINT32, SECTOR* );
+int		set_clusters_used( CLUSTER_BITMAP*, SECTOR, UINT32 );
+UINT32	set_clusters_free( CLUSTER_BITMAP*, SECTOR, UINT32 );
+void	release_cluster_bitmap( CLUSTER_BITMAP* );
+
+#endif
+
@@ -0,0 +1,227 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : dentrycache.c                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Directory entry cache                                            */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <string.h>
+#include "common.h"
+#include "dentrycache.h"
+
+#define LOCATION_HASH( cache, cluster, sector, number ) \
+	( ( ( cluster ) * 131 + ( sector ) * 16 + ( number ) ) & ( cache )->hashMask )
+
+/* FNV-1a of the directory and the name */
+UINT32 hash_dentry_name( const DENTRY_CACHE* cache, SECTOR parent, const BYTE* name )
+{
+	UINT32	hash = 2166136261u;
+	int		i;
+
+	for( i = 0; i < 4; i++ )
+		hash = ( hash ^ ( ( parent >> ( i * 8 ) ) & 0xFF ) ) * 16777619u;
+	for( i = 0; i < DENTRY_NAME_LENGTH; i++ )
+		hash = ( hash ^ name[i] ) * 16777619u;
+
+	return hash & cache->hashMask;
+}
+
+int init_dentry_cache( DENTRY_CACHE* cache, UINT32 count )
+{
+	UINT32	i, hashSize = 1;
+
+	ZeroMemory( cache, sizeof( DENTRY_CACHE ) );
+
+	if( count == 0 )
+		return FAT_SUCCESS;
+
+	while( hashSize < count )
+		hashSize <<= 1;
+
+	cache->entries		= ( DENTRY* )calloc( count, sizeof( DENTRY ) );
+	cache->nameHash		= ( DENTRY** )calloc( hashSize, sizeof( DENTRY* ) );
+	cache->locationHash	= ( DENTRY** )calloc( hashSize, sizeof( DENTRY* ) );
+	if( cache->entries == NULL || cache->nameHash == NULL || cache->locationHash == NULL )
+	{
+		release_dentry_cache( cache );
+		return FAT_ERROR;
+	}
+
+	cache->count	= count;
+	cache->hashMask	= hashSize - 1;
+
+	for( i = 0; i < count; i++ )
+	{
+		cache->entries[i].prev	= ( i > 0 ? &cache->entries[i - 1] : NULL );
+		cache->entries[i].next	= ( i < count - 1 ? &cache->entries[i + 1] : NULL );
+	}
+	cache->first	= &cache->entries[0];
+	cache->last		= &cache->entries[count - 1];
+
+	return FAT_SUCCESS;
+}
+
+void release_dentry_cache( DENTRY_CACHE* cache )
+{
+	free( cache->entries );
+	free( cache->nameHash );
+	free( cache->locationHash );
+
+	ZeroMemory( cache, sizeof( DENTRY_CACHE ) );
+}
+
+DENTRY* find_dentry( DENTRY_CACHE* cache, SECTOR parent, const BYTE* name )
+{
+	DENTRY*	dentry;
+
+	if( cache->count == 0 )
+		return NULL;
+
+	for( dentry = cache->nameHash[hash_dentry_name( cache, parent, name )]; dentry; dentry = dentry->nameNext )
+	{
+		if( dentry->parent == parent && memcmp( dentry->name, name, DENTRY_NAME_LENGTH ) == 0 )
+		{
+			cache->hits++;
+			return dentry;
+		}
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+DENTRY* find_dentry_at( DENTRY_CACHE* cache, SECTOR cluster, UINT32 sector, INT32 number )
+{
+	DENTRY*	dentry;
+
+	if( cache->count == 0 )
+		return NULL;
+
+	for( dentry = cache->locationHash[LOCATION_HASH( cache, cluster, sector, number )]; dentry; dentry = dentry->locationNext )
+	{
+		if( dentry->cluster == cluster && dentry->sector == sector && dentry->number == number )
+			return dentry;
+	}
+
+	return NULL;
+}
+
+/* moves the entry to the head of the LRU list */
+void touch_dentry( DENTRY_CACHE* cache, DENTRY* dentry )
+{
+	if( cache->first == dentry )
+		return;
+
+	dentry->prev->next = dentry->next;
+	if( dentry->next )
+		dentry->next->prev = dentry->prev;
+	else
+		cache->last = dentry->prev;
+
+	dentry->prev = NULL;
+	dentry->next = cache->first;
+	cache->first->prev = dentry;
+	cache->first = dentry;
+}
+
+void remove_dentry( DENTRY_CACHE* cache, DENTRY* dentry )
+{
+	DENTRY**	link;
+
+	link = &cache->nameHash[hash_dentry_name( cache, dentry->parent, dentry->name )];
+	while( *link != dentry )
+		link = &( *link )->nameNext;
+	*link = dentry->nameNext;
+
+	link = &cache->locationHash[LOCATION_HASH( cache, dentry->cluster, dentry->sector, dentry->number )];
+	while( *link != dentry )
+		link = &( *link )->locationNext;
+	*link = dentry->locationNext;
+
+	dentry->valid = 0;
+
+	/* an unused entry is the first one to be reused */
+	if( cache->last != dentry )
+	{
+		if( dentry->prev )
+			dentry->prev->next = dentry->next;
+		else
+			cache->first = dentry->next;
+		dentry->next->prev = dentry->prev;
+
+		dentry->prev = cache->last;
+		dentry->next = NULL;
+		cache->last->next = dentry;
+		cache->last = dentry;
+	}
+}
+
+/* Cache the directory entry at a location of the directory starting at parent. The name is
+ * the first field of the entry. An entry cached at the same location or by the same name is
+ * replaced, otherwise the least recently used one is */
+DENTRY* add_dentry( DENTRY_CACHE* cache, SECTOR parent, SECTOR cluster, UINT32 sector, INT32 number, const void* entry )
+{
+	DENTRY*	dentry;
+	UINT32	hash;
+
+	if( cache->count == 0 )
+		return NULL;
+
+	dentry = find_dentry_at( cache, cluster, sector, number );
+	if( dentry && ( dentry->parent != parent || memcmp( dentry->name, entry, DENTRY_NAME_LENGTH ) != 0 ) )
+	{
+		remove_dentry( cache, dentry );
+		dentry = NULL;
+	}
+
+	if( dentry == NULL )
+	{
+		hash = hash_dentry_name( cache, parent, ( const BYTE* )entry );
+		for( dentry = cache->nameHash[hash]; dentry; dentry = dentry->nameNext )
+		{
+			if( dentry->parent == parent && memcmp( dentry->name, entry, DENTRY_NAME_LENGTH ) == 0 )
+				break;
+		}
+
+		/* the same name somewhere else of the directory was deleted without the cache knowing */
+		if( dentry )
+			remove_dentry( cache, dentry );
+
+		dentry = cache->last;
+		if( dentry->valid )
+			remove_dentry( cache, dentry );
+
+		dentry->parent	= parent;
+		dentry->cluster	= cluster;
+		dentry->sector	= sector;
+		dentry->number	= number;
+		dentry->valid	= 1;
+		memcpy( dentry->name, entry, DENTRY_NAME_LENGTH );
+
+		dentry->nameNext = cache->nameHash[hash];
+		cache->nameHash[hash] = dentry;
+		dentry->locationNext = cache->locationHash[LOCATION_HASH( cache, cluster, sector, number )];
+		cache->locationHash[LOCATION_HASH( cache, cluster, sector, number )] = dentry;
+	}
+
+	memcpy( dentry->entry, entry, DENTRY_ENTRY_SIZE );
+	touch_dentry( cache, dentry );
+
+	return dentry;
+}
+
+/* drops the entries of a removed directory, its clusters may hold anything next */
+void invalidate_dentry_dir( DENTRY_CACHE* cache, SECTOR parent )
+{
+	UINT32	i;
+
+	for( i = 0; i < cache->count; i++ )
+	{
+		if( cache->entries[i].valid && cache->entries[i].parent == parent )
+			remove_dentry( cache, &cache->entries[i] );
+	}
+}
@@ -0,0 +1,62 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : dentrycache.h                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Directory entry cache header                                     */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DENTRYCACHE_H_
+#define _DENTRYCACHE_H_
+
+#include "common.h"
+
+#define DENTRY_CACHE_DEFAULT_SIZE	4096
+#define DENTRY_NAME_LENGTH			11		/* formatted 8.3 name */
+#define DENTRY_ENTRY_SIZE			32		/* a directory entry on the disk */
+
+/* a directory entry found by a lookup, hashed by its directory and name and by where it is */
+typedef struct DENTRY
+{
+	SECTOR			parent;						/* first cluster of the directory */
+	BYTE			name[DENTRY_NAME_LENGTH];
+	BYTE			valid;
+	BYTE			entry[DENTRY_ENTRY_SIZE];	/* as it is on the disk */
+
+	SECTOR			cluster;					/* location of the entry */
+	UINT32			sector;
+	INT32			number;
+
+	struct DENTRY*	nameNext;
+	struct DENTRY*	locationNext;
+	struct DENTRY*	prev;		/* LRU list, the most recently used one is first */
+	struct DENTRY*	next;
+} DENTRY;
+
+typedef struct
+{
+	UINT32			count;			/* 0 caches nothing */
+	UINT32			hashMask;
+
+	DENTRY*			entries;
+	DENTRY**		nameHash;
+	DENTRY**		locationHash;
+	DENTRY*			first;
+	DENTRY*			last;
+
+	UINT32			hits;
+	UINT32			misses;
+} DENTRY_CACHE;
+
+int		init_dentry_cache( DENTRY_CACHE*, UINT32 );
+DENTRY*	find_dentry( DENTRY_CACHE*, SECTOR, const BYTE* );
+DENTRY*	find_dentry_at( DENTRY_CACHE*, SECTOR, UINT32, INT32 );
+DENTRY*	add_dentry( DENTRY_CACHE*, SECTOR, SECTOR, UINT32, INT32, const void* );
+void	remove_dentry( DENTRY_CACHE*, DENTRY* );
+void	invalidate_dentry_dir( DENTRY_CACHE*, SECTOR );
+void	release_dentry_cache( DENTRY_CACHE* );
+
+#endif
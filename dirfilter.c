@@ -0,0 +1,217 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : dirfilter.c                                                      */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Directory name filter                                            */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <string.h>
+#include "common.h"
+#include "dirfilter.h"
+
+#define DIR_FILTER_MIN_BITS		512
+#define DIR_FILTER_INITIAL_NAMES	64
+
+/* two FNV-1a hashes of the name, the bits of a name are first + i * second */
+void hash_dir_filter_name( const BYTE* name, UINT32* first, UINT32* second )
+{
+	UINT32	hash1 = 2166136261u, hash2 = 5381;
+	int		i;
+
+	for( i = 0; i < DIR_FILTER_NAME_LENGTH; i++ )
+	{
+		hash1 = ( hash1 ^ name[i] ) * 16777619u;
+		hash2 = hash2 * 33 + name[i];
+	}
+
+	*first	= hash1;
+	*second	= hash2 | 1;
+}
+
+void set_dir_filter_bits( DIR_FILTER* filter, UINT32 first, UINT32 second )
+{
+	UINT32	i, bit;
+
+	for( i = 0; i < DIR_FILTER_HASHES; i++ )
+	{
+		bit = ( first + i * second ) & filter->mask;
+		filter->bits[bit / 8] |= 1 << ( bit % 8 );
+	}
+	filter->names++;
+}
+
+void init_dir_filters( DIR_FILTER_SET* set )
+{
+	ZeroMemory( set, sizeof( DIR_FILTER_SET ) );
+}
+
+void release_dir_filters( DIR_FILTER_SET* set )
+{
+	UINT32	i;
+
+	for( i = 0; i < DIR_FILTER_COUNT; i++ )
+		free( set->filters[i].bits );
+	free( set->hashes );
+
+	ZeroMemory( set, sizeof( DIR_FILTER_SET ) );
+}
+
+DIR_FILTER* find_dir_filter( DIR_FILTER_SET* set, SECTOR parent )
+{
+	UINT32	i;
+
+	for( i = 0; i < DIR_FILTER_COUNT; i++ )
+	{
+		if( set->filters[i].valid && set->filters[i].parent == parent )
+		{
+			set->filters[i].lastUsed = ++set->clock;
+			return &set->filters[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* 0 when the name is surely not in the directory */
+int dir_filter_may_contain( const DIR_FILTER* filter, const BYTE* name )
+{
+	UINT32	first, second, i, bit;
+
+	hash_dir_filter_name( name, &first, &second );
+
+	for( i = 0; i < DIR_FILTER_HASHES; i++ )
+	{
+		bit = ( first + i * second ) & filter->mask;
+		if( !( filter->bits[bit / 8] & ( 1 << ( bit % 8 ) ) ) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* the names of a directory scan are collected until it reaches the end of the directory */
+void start_dir_filter( DIR_FILTER_SET* set )
+{
+	set->collecting	= 1;
+	set->count		= 0;
+}
+
+void collect_dir_filter_name( DIR_FILTER_SET* set, const BYTE* name )
+{
+	UINT32*	hashes;
+	UINT32	size;
+
+	if( !set->collecting )
+		return;
+
+	if( set->count + 2 > set->size )
+	{
+		size	= set->size ? set->size * 2 : DIR_FILTER_INITIAL_NAMES * 2;
+		hashes	= ( UINT32* )realloc( set->hashes, size * sizeof( UINT32 ) );
+		if( hashes == NULL )
+		{
+			set->collecting = 0;
+			return;
+		}
+		set->hashes	= hashes;
+		set->size	= size;
+	}
+
+	hash_dir_filter_name( name, &set->hashes[set->count], &set->hashes[set->count + 1] );
+	set->count += 2;
+}
+
+void cancel_dir_filter( DIR_FILTER_SET* set )
+{
+	set->collecting = 0;
+}
+
+/* Build the filter of the directory from the names collected, it is sized for twice as many
+ * names so the entries created later fit. The least recently used filter is replaced */
+int finish_dir_filter( DIR_FILTER_SET* set, SECTOR parent )
+{
+	DIR_FILTER*	filter;
+	UINT32		i, bits = DIR_FILTER_MIN_BITS, names;
+	BYTE*		bitmap;
+
+	if( !set->collecting )
+		return FAT_ERROR;
+	set->collecting = 0;
+
+	names = set->count / 2;
+	while( bits < ( names * 2 + 32 ) * DIR_FILTER_BITS_PER_NAME )
+		bits <<= 1;
+
+	filter = find_dir_filter( set, parent );
+	if( filter == NULL )
+	{
+		filter = &set->filters[0];
+		for( i = 0; i < DIR_FILTER_COUNT; i++ )
+		{
+			if( !set->filters[i].valid )
+			{
+				filter = &set->filters[i];
+				break;
+			}
+			if( set->filters[i].lastUsed < filter->lastUsed )
+				filter = &set->filters[i];
+		}
+	}
+
+	bitmap = ( BYTE* )calloc( bits / 8, 1 );
+	if( bitmap == NULL )
+		return FAT_ERROR;
+
+	free( filter->bits );
+	filter->bits		= bitmap;
+	filter->parent		= parent;
+	filter->valid		= 1;
+	filter->lastUsed	= ++set->clock;
+	filter->names		= 0;
+	filter->capacity	= bits / DIR_FILTER_BITS_PER_NAME;
+	filter->mask		= bits - 1;
+
+	for( i = 0; i < set->count; i += 2 )
+		set_dir_filter_bits( filter, set->hashes[i], set->hashes[i + 1] );
+
+	return FAT_SUCCESS;
+}
+
+/* a name inserted into a directory, a filter too full to stay accurate is dropped */
+void add_dir_filter_name( DIR_FILTER_SET* set, SECTOR parent, const BYTE* name )
+{
+	DIR_FILTER*	filter;
+	UINT32		first, second;
+
+	filter = find_dir_filter( set, parent );
+	if( filter == NULL )
+		return;
+
+	if( filter->names >= filter->capacity )
+	{
+		invalidate_dir_filter( set, parent );
+		return;
+	}
+
+	hash_dir_filter_name( name, &first, &second );
+	set_dir_filter_bits( filter, first, second );
+}
+
+void invalidate_dir_filter( DIR_FILTER_SET* set, SECTOR parent )
+{
+	UINT32	i;
+
+	for( i = 0; i < DIR_FILTER_COUNT; i++ )
+	{
+		if( set->filters[i].valid && set->filters[i].parent == parent )
+		{
+			free( set->filters[i].bits );
+			set->filters[i].bits	= NULL;
+			set->filters[i].valid	= 0;
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : dirfilter.h                                                      */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Directory name filter header                                     */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DIRFILTER_H_
+#define _DIRFILTER_H_
+
+#include "common.h"
+
+#define DIR_FILTER_COUNT		16
+#define DIR_FILTER_NAME_LENGTH	11		/* formatted 8.3 name */
+#define DIR_FILTER_BITS_PER_NAME	16	/* about 0.1% false positives with DIR_FILTER_HASHES */
+#define DIR_FILTER_HASHES		6
+
+/* Bloom filter of the names in a directory, built by a scan that read the whole directory.
+ * A name it does not hold is not in the directory. Removed names stay set until the filter is
+ * built again, they only make a lookup scan the directory */
+typedef struct
+{
+	SECTOR			parent;			/* first cluster of the directory */
+	BYTE			valid;
+	UINT32			lastUsed;
+	UINT32			names;
+	UINT32			capacity;		/* names it holds before it is dropped */
+	UINT32			mask;			/* bits - 1 */
+	BYTE*			bits;
+} DIR_FILTER;
+
+/* the filters of the directories looked up most recently and the names of the scan in progress */
+typedef struct
+{
+	DIR_FILTER		filters[DIR_FILTER_COUNT];
+	UINT32			clock;
+
+	BYTE			collecting;
+	UINT32*			hashes;			/* two per name */
+	UINT32			count;
+	UINT32			size;
+
+	UINT32			negatives;		/* lookups answered by a filter */
+	UINT32			falsePositives;
+} DIR_FILTER_SET;
+
+void		init_dir_filters( DIR_FILTER_SET* );
+DIR_FILTER*	find_dir_filter( DIR_FILTER_SET*, SECTOR );
+int			dir_filter_may_contain( const DIR_FILTER*, const BYTE* );
+void		start_dir_filter( DIR_FILTER_SET* );
+void		collect_dir_filter_name( DIR_FILTER_SET*, const BYTE* );
+int			finish_dir_filter( DIR_FILTER_SET*, SECTOR );
+void		cancel_dir_filter( DIR_FILTER_SET* );
+void		add_dir_filter_name( DIR_FILTER_SET*, SECTOR, const BYTE* );
+void		invalidate_dir_filter( DIR_FILTER_SET*, SECTOR );
+void		release_dir_filters( DIR_FILTER_SET* );
+
+#endif
@@ -0,0 +1,185 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : disk.c                                                           */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Disk device helpers                                              */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "disk.h"
+
+/* Runs a batch of requests to completion. Asynchronous disks keep as many of them in flight
+ * as they can take, synchronous disks run them one by one */
+int disk_transfer_requests( DISK_OPERATIONS* disk, DISK_REQUEST* requests, int count )
+{
+	int		i, submitted = 0, completed = 0, result;
+
+	for( i = 0; i < count; i++ )
+		requests[i].result = DISK_REQUEST_PENDING;
+
+	if( disk->submit == NULL )
+	{
+		for( i = 0; i < count; i++ )
+		{
+			if( requests[i].write )
+				requests[i].result = disk->write_sectors_v( disk, requests[i].sector, requests[i].iov, requests[i].iovCount );
+			else
+				requests[i].result = disk->read_sectors_v( disk, requests[i].sector, requests[i].iov, requests[i].iovCount );
+
+			if( requests[i].result )
+				return -1;
+		}
+
+		return 0;
+	}
+
+	while( completed < count )
+	{
+		if( submitted < count )
+		{
+			result = disk->submit( disk, &requests[submitted], count - submitted );
+			if( result < 0 )
+				break;
+			submitted += result;
+		}
+
+		result = disk->complete( disk, 1 );
+		if( result < 0 )
+			break;
+		completed += result;
+	}
+
+	/* requests that were never submitted or did not complete are reaped before returning */
+	while( completed < submitted )
+	{
+		result = disk->complete( disk, 1 );
+		if( result <= 0 )
+			return -1;
+		completed += result;
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		if( requests[i].result )
+			return -1;
+	}
+
+	return 0;
+}
+
+#define LOCKED_DISK( disk )		( ( DISK_LOCKED* )( disk )->pdata )
+
+int locked_read_sector( DISK_OPERATIONS* disk, SECTOR sector, void* data )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result;
+
+	pthread_mutex_lock( &locked->lock );
+	result = locked->disk->read_sector( locked->disk, sector, data );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int locked_write_sector( DISK_OPERATIONS* disk, SECTOR sector, const void* data )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result;
+
+	pthread_mutex_lock( &locked->lock );
+	result = locked->disk->write_sector( locked->disk, sector, data );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int locked_read_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, void* data )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result;
+
+	pthread_mutex_lock( &locked->lock );
+	result = locked->disk->read_sectors( locked->disk, sector, count, data );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int locked_write_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, const void* data )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result;
+
+	pthread_mutex_lock( &locked->lock );
+	result = locked->disk->write_sectors( locked->disk, sector, count, data );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int locked_read_sectors_v( DISK_OPERATIONS* disk, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result;
+
+	pthread_mutex_lock( &locked->lock );
+	result = locked->disk->read_sectors_v( locked->disk, sector, iov, iovCount );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int locked_write_sectors_v( DISK_OPERATIONS* disk, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result;
+
+	pthread_mutex_lock( &locked->lock );
+	result = locked->disk->write_sectors_v( locked->disk, sector, iov, iovCount );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int locked_flush( DISK_OPERATIONS* disk )
+{
+	DISK_LOCKED*	locked = LOCKED_DISK( disk );
+	int				result = 0;
+
+	pthread_mutex_lock( &locked->lock );
+	if( locked->disk->flush )
+		result = locked->disk->flush( locked->disk );
+	pthread_mutex_unlock( &locked->lock );
+
+	return result;
+}
+
+int disk_init_locked( DISK_LOCKED* locked, DISK_OPERATIONS* disk )
+{
+	if( pthread_mutex_init( &locked->lock, NULL ) )
+		return -1;
+
+	locked->disk						= disk;
+	locked->operations.read_sector		= locked_read_sector;
+	locked->operations.write_sector		= locked_write_sector;
+	locked->operations.read_sectors		= locked_read_sectors;
+	locked->operations.write_sectors	= locked_write_sectors;
+	locked->operations.read_sectors_v	= locked_read_sectors_v;
+	locked->operations.write_sectors_v	= locked_write_sectors_v;
+	locked->operations.flush			= locked_flush;
+	locked->operations.submit			= NULL;
+	locked->operations.complete			= NULL;
+	locked->operations.numberOfSectors	= disk->numberOfSectors;
+	locked->operations.bytesPerSector	= disk->bytesPerSector;
+	locked->operations.pdata			= locked;
+
+	return 0;
+}
+
+void disk_uninit_locked( DISK_LOCKED* locked )
+{
+	pthread_mutex_destroy( &locked->lock );
+}
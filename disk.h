@@ -12,16 +12,60 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <pthread.h>
 #include "common.h"
 
+/* one segment of a scatter/gather transfer, its sectors follow the previous segment's */
+typedef struct
+{
+	void*	buffer;
+	UINT32	count;		/* in sectors */
+} DISK_IOVEC;
+
+#define DISK_REQUEST_PENDING	1
+
+/* an asynchronous transfer, result is DISK_REQUEST_PENDING until the request is completed,
+ * then 0 on success or a negative error. The vector must stay valid until then */
+typedef struct
+{
+	BYTE				write;
+	SECTOR				sector;
+	const DISK_IOVEC*	iov;
+	int					iovCount;
+	int					result;
+} DISK_REQUEST;
+
 typedef struct DISK_OPERATIONS
 {
 	int		( *read_sector	)( struct DISK_OPERATIONS*, SECTOR, void* );
 	int		( *write_sector	)( struct DISK_OPERATIONS*, SECTOR, const void* );
+	int		( *read_sectors	)( struct DISK_OPERATIONS*, SECTOR, UINT32, void* );
+	int		( *write_sectors	)( struct DISK_OPERATIONS*, SECTOR, UINT32, const void* );
+	int		( *read_sectors_v	)( struct DISK_OPERATIONS*, SECTOR, const DISK_IOVEC*, int );
+	int		( *write_sectors_v	)( struct DISK_OPERATIONS*, SECTOR, const DISK_IOVEC*, int );
+	int		( *flush		)( struct DISK_OPERATIONS* );
+	/* optional, NULL when the disk is synchronous only
+	 * submit queues requests and returns how many were queued, the rest must wait for completions
+	 * complete waits for at least the given number of completions and returns how many were reaped */
+	int		( *submit		)( struct DISK_OPERATIONS*, DISK_REQUEST*, int );
+	int		( *complete		)( struct DISK_OPERATIONS*, int );
 	SECTOR	numberOfSectors;
 	int		bytesPerSector;
 	void*	pdata;
 } DISK_OPERATIONS;
 
+/* Serializes the operations of a disk that is shared with another thread. The locked disk is
+ * synchronous, as requests in flight could be completed by the wrong thread */
+typedef struct
+{
+	DISK_OPERATIONS		operations;
+	DISK_OPERATIONS*	disk;
+	pthread_mutex_t		lock;
+} DISK_LOCKED;
+
+int		disk_transfer_requests( DISK_OPERATIONS*, DISK_REQUEST*, int );
+int		disk_init_locked( DISK_LOCKED*, DISK_OPERATIONS* );
+void	disk_uninit_locked( DISK_LOCKED* );
+
 #endif
 
@@ -9,19 +9,73 @@
 /*                                                                            */
 /******************************************************************************/
 
+#define _GNU_SOURCE				/* O_DIRECT */
 #include <stdlib.h>
 #include <memory.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "fat.h"
 #include "disk.h"
 #include "disksim.h"
 
+#define DISKSIM_MEMORY			0
+#define DISKSIM_FILE			1
+
+#define DIRECT_IO_ALIGNMENT		4096
+#define BOUNCE_SECTORS			128
+#define MAX_IOVEC				64
+
+#define MIN( a, b )				( ( a ) < ( b ) ? ( a ) : ( b ) )
+
 typedef struct
 {
+	BYTE	type;
 	char*	address;
+	int		fd;			/* -1 when the disk lives only in memory */
+	size_t	length;
 } DISK_MEMORY;
 
+typedef struct
+{
+	BYTE	type;
+	int		fd;
+	int		direct;
+	char*	bounce;		/* aligned staging buffer for O_DIRECT transfers */
+} DISK_FILE;
+
 int disksim_read( DISK_OPERATIONS* this, SECTOR sector, void* data );
 int disksim_write( DISK_OPERATIONS* this, SECTOR sector, const void* data );
+int disksim_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data );
+int disksim_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data );
+int disksim_read_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount );
+int disksim_write_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount );
+int disksim_flush( DISK_OPERATIONS* this );
+int disksim_file_read( DISK_OPERATIONS* this, SECTOR sector, void* data );
+int disksim_file_write( DISK_OPERATIONS* this, SECTOR sector, const void* data );
+int disksim_file_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data );
+int disksim_file_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data );
+int disksim_file_read_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount );
+int disksim_file_write_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount );
+int disksim_file_flush( DISK_OPERATIONS* this );
+
+void disksim_set_operations( DISK_OPERATIONS* disk, SECTOR numberOfSectors, unsigned int bytesPerSector )
+{
+	disk->read_sector	= disksim_read;
+	disk->write_sector	= disksim_write;
+	disk->read_sectors	= disksim_read_sectors;
+	disk->write_sectors	= disksim_write_sectors;
+	disk->read_sectors_v	= disksim_read_sectors_v;
+	disk->write_sectors_v	= disksim_write_sectors_v;
+	disk->flush			= disksim_flush;
+	disk->submit		= NULL;
+	disk->complete		= NULL;
+	disk->numberOfSectors	= numberOfSectors;
+	disk->bytesPerSector	= bytesPerSector;
+}
 
 int disksim_init( SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPERATIONS* disk ) // ʱȭ
 {
@@ -35,15 +89,129 @@ int disksim_init( SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPER
 		return -1;
 	}
 
-	( ( DISK_MEMORY* )disk->pdata )->address = ( char* )malloc( bytesPerSector * numberOfSectors );
+	( ( DISK_MEMORY* )disk->pdata )->type = DISKSIM_MEMORY;
+	( ( DISK_MEMORY* )disk->pdata )->fd = -1;
+	( ( DISK_MEMORY* )disk->pdata )->length = ( size_t )bytesPerSector * numberOfSectors;
+	( ( DISK_MEMORY* )disk->pdata )->address = ( char* )malloc( ( size_t )bytesPerSector * numberOfSectors );
+	if( ( ( DISK_MEMORY* )disk->pdata )->address == NULL )
+	{
+		disksim_uninit( disk );
+		return -1;
+	}
+
+	disksim_set_operations( disk, numberOfSectors, bytesPerSector );
+
+	return 0;
+}
+
+/* Maps an image file into memory. An empty or new file is sized to numberOfSectors,
+ * an existing image keeps its own size */
+int disksim_init_file( const char* path, SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPERATIONS* disk )
+{
+	DISK_MEMORY*	memory;
+	struct stat		st;
+
+	if( disk == NULL || path == NULL )
+		return -1;
+
+	disk->pdata = malloc( sizeof( DISK_MEMORY ) );
 	if( disk->pdata == NULL )
+		return -1;
+
+	memory = ( DISK_MEMORY* )disk->pdata;
+	memory->type = DISKSIM_MEMORY;
+	memory->address = NULL;
+	memory->fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( memory->fd < 0 || fstat( memory->fd, &st ) )
 	{
 		disksim_uninit( disk );
 		return -1;
 	}
 
-	disk->read_sector	= disksim_read;
-	disk->write_sector	= disksim_write;
+	if( st.st_size < bytesPerSector )
+	{
+		if( ftruncate( memory->fd, ( off_t )bytesPerSector * numberOfSectors ) )
+		{
+			disksim_uninit( disk );
+			return -1;
+		}
+	}
+	else
+		numberOfSectors = st.st_size / bytesPerSector;
+
+	memory->length = ( size_t )bytesPerSector * numberOfSectors;
+	memory->address = mmap( NULL, memory->length, PROT_READ | PROT_WRITE, MAP_SHARED, memory->fd, 0 );
+	if( memory->address == MAP_FAILED )
+	{
+		memory->address = NULL;
+		disksim_uninit( disk );
+		return -1;
+	}
+
+	disksim_set_operations( disk, numberOfSectors, bytesPerSector );
+
+	return 0;
+}
+
+/* Accesses an image file with pread/pwrite. With DISKSIM_DIRECT the page cache is
+ * bypassed, buffers that are not aligned for O_DIRECT go through a bounce buffer */
+int disksim_init_fd( const char* path, SECTOR numberOfSectors, unsigned int bytesPerSector, int flags, DISK_OPERATIONS* disk )
+{
+	DISK_FILE*		file;
+	struct stat		st;
+	int				openFlags = O_RDWR | O_CREAT;
+
+	if( disk == NULL || path == NULL )
+		return -1;
+
+	disk->pdata = malloc( sizeof( DISK_FILE ) );
+	if( disk->pdata == NULL )
+		return -1;
+
+	file = ( DISK_FILE* )disk->pdata;
+	file->type = DISKSIM_FILE;
+	file->direct = ( flags & DISKSIM_DIRECT ) != 0;
+	file->bounce = NULL;
+
+	if( file->direct )
+	{
+		openFlags |= O_DIRECT;
+		if( posix_memalign( ( void** )&file->bounce, DIRECT_IO_ALIGNMENT, BOUNCE_SECTORS * bytesPerSector ) )
+		{
+			file->bounce = NULL;
+			file->fd = -1;
+			disksim_uninit( disk );
+			return -1;
+		}
+	}
+
+	file->fd = open( path, openFlags, 0644 );
+	if( file->fd < 0 || fstat( file->fd, &st ) )
+	{
+		disksim_uninit( disk );
+		return -1;
+	}
+
+	if( st.st_size < bytesPerSector )
+	{
+		if( ftruncate( file->fd, ( off_t )bytesPerSector * numberOfSectors ) )
+		{
+			disksim_uninit( disk );
+			return -1;
+		}
+	}
+	else
+		numberOfSectors = st.st_size / bytesPerSector;
+
+	disk->read_sector	= disksim_file_read;
+	disk->write_sector	= disksim_file_write;
+	disk->read_sectors	= disksim_file_read_sectors;
+	disk->write_sectors	= disksim_file_write_sectors;
+	disk->read_sectors_v	= disksim_file_read_sectors_v;
+	disk->write_sectors_v	= disksim_file_write_sectors_v;
+	disk->flush			= disksim_file_flush;
+	disk->submit		= NULL;
+	disk->complete		= NULL;
 	disk->numberOfSectors	= numberOfSectors;
 	disk->bytesPerSector	= bytesPerSector;
 
@@ -52,13 +220,53 @@ int disksim_init( SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPER
 
 void disksim_uninit( DISK_OPERATIONS* this )
 {
-	if( this )
+	DISK_MEMORY*	memory;
+	DISK_FILE*		file;
+
+	if( this && this->pdata && *( BYTE* )this->pdata == DISKSIM_FILE )
 	{
-		if( this->pdata )
-			free( this->pdata );
+		file = ( DISK_FILE* )this->pdata;
+
+		if( file->fd >= 0 )
+		{
+			fdatasync( file->fd );
+			close( file->fd );
+		}
+		free( file->bounce );
+		free( this->pdata );
+		this->pdata = NULL;
+	}
+	else if( this && this->pdata )
+	{
+		memory = ( DISK_MEMORY* )this->pdata;
+
+		if( memory->fd < 0 )
+			free( memory->address );
+		else
+		{
+			if( memory->address )
+			{
+				msync( memory->address, memory->length, MS_SYNC );
+				munmap( memory->address, memory->length );
+			}
+			close( memory->fd );
+		}
+
+		free( this->pdata );
+		this->pdata = NULL;
 	}
 }
 
+int disksim_flush( DISK_OPERATIONS* this )
+{
+	DISK_MEMORY*	memory = ( DISK_MEMORY* )this->pdata;
+
+	if( memory->fd < 0 )
+		return 0;
+
+	return msync( memory->address, memory->length, MS_SYNC );
+}
+
 int disksim_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
 {
 	char* disk = ( ( DISK_MEMORY* )this->pdata )->address; // ó    ּ
@@ -66,7 +274,7 @@ int disksim_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
 	if( sector < 0 || sector >= this->numberOfSectors )
 		return -1;
 
-	memcpy( data, &disk[sector * this->bytesPerSector], this->bytesPerSector ); //ũ ͸ data 
+	memcpy( data, &disk[( size_t )sector * this->bytesPerSector], this->bytesPerSector ); //ũ ͸ data 
 
 	return 0;
 }
@@ -78,8 +286,207 @@ int disksim_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
 	if( sector < 0 || sector >= this->numberOfSectors )
 		return -1;
 
-	memcpy( &disk[sector * this->bytesPerSector], data, this->bytesPerSector ); // data ũ 
+	memcpy( &disk[( size_t )sector * this->bytesPerSector], data, this->bytesPerSector ); // data ũ 
+
+	return 0;
+}
+
+int disksim_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	char* disk = ( ( DISK_MEMORY* )this->pdata )->address;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	memcpy( data, &disk[( size_t )sector * this->bytesPerSector], ( size_t )count * this->bytesPerSector );
+
+	return 0;
+}
+
+int disksim_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	char* disk = ( ( DISK_MEMORY* )this->pdata )->address;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	memcpy( &disk[( size_t )sector * this->bytesPerSector], data, ( size_t )count * this->bytesPerSector );
+
+	return 0;
+}
+
+int disksim_read_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	int i;
+
+	for( i = 0; i < iovCount; i++ )
+	{
+		if( disksim_read_sectors( this, sector, iov[i].count, iov[i].buffer ) )
+			return -1;
+
+		sector += iov[i].count;
+	}
+
+	return 0;
+}
+
+int disksim_write_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	int i;
+
+	for( i = 0; i < iovCount; i++ )
+	{
+		if( disksim_write_sectors( this, sector, iov[i].count, iov[i].buffer ) )
+			return -1;
+
+		sector += iov[i].count;
+	}
+
+	return 0;
+}
+
+/******************************************************************************/
+/* pread/pwrite backend                                                       */
+/******************************************************************************/
+int disksim_file_io( DISK_FILE* file, int write, off_t offset, size_t length, char* data )
+{
+	ssize_t	done;
+
+	while( length > 0 )
+	{
+		if( write )
+			done = pwrite( file->fd, data, length, offset );
+		else
+			done = pread( file->fd, data, length, offset );
+
+		if( done < 0 && errno == EINTR )
+			continue;
+		if( done <= 0 )
+			return -1;
+
+		data += done;
+		offset += done;
+		length -= done;
+	}
+
+	return 0;
+}
+
+/* O_DIRECT needs an aligned buffer, other buffers are staged through the bounce buffer */
+int disksim_file_transfer( DISK_OPERATIONS* this, int write, SECTOR sector, UINT32 count, char* data )
+{
+	DISK_FILE*	file = ( DISK_FILE* )this->pdata;
+	UINT32		chunk;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	if( !file->direct || ( ( size_t )data % DIRECT_IO_ALIGNMENT ) == 0 )
+		return disksim_file_io( file, write, ( off_t )sector * this->bytesPerSector, ( size_t )count * this->bytesPerSector, data );
+
+	while( count > 0 )
+	{
+		chunk = MIN( count, BOUNCE_SECTORS );
+
+		if( write )
+			memcpy( file->bounce, data, ( size_t )chunk * this->bytesPerSector );
+
+		if( disksim_file_io( file, write, ( off_t )sector * this->bytesPerSector, ( size_t )chunk * this->bytesPerSector, file->bounce ) )
+			return -1;
+
+		if( !write )
+			memcpy( data, file->bounce, ( size_t )chunk * this->bytesPerSector );
+
+		data += ( size_t )chunk * this->bytesPerSector;
+		sector += chunk;
+		count -= chunk;
+	}
+
+	return 0;
+}
+
+int disksim_file_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	return disksim_file_transfer( this, 0, sector, 1, ( char* )data );
+}
+
+int disksim_file_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	return disksim_file_transfer( this, 1, sector, 1, ( char* )data );
+}
+
+int disksim_file_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	return disksim_file_transfer( this, 0, sector, count, ( char* )data );
+}
+
+int disksim_file_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	return disksim_file_transfer( this, 1, sector, count, ( char* )data );
+}
+
+/* buffered files take the whole vector in one preadv/pwritev, O_DIRECT goes segment by segment */
+int disksim_file_transfer_v( DISK_OPERATIONS* this, int write, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	DISK_FILE*		file = ( DISK_FILE* )this->pdata;
+	struct iovec	vector[MAX_IOVEC];
+	UINT32			count = 0;
+	ssize_t			expected = 0, done;
+	int				i;
+
+	if( file->direct || iovCount > MAX_IOVEC )
+	{
+		for( i = 0; i < iovCount; i++ )
+		{
+			if( disksim_file_transfer( this, write, sector, iov[i].count, ( char* )iov[i].buffer ) )
+				return -1;
+			sector += iov[i].count;
+		}
+
+		return 0;
+	}
+
+	for( i = 0; i < iovCount; i++ )
+	{
+		vector[i].iov_base	= iov[i].buffer;
+		vector[i].iov_len	= ( size_t )iov[i].count * this->bytesPerSector;
+		expected += vector[i].iov_len;
+		count += iov[i].count;
+	}
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	if( write )
+		done = pwritev( file->fd, vector, iovCount, ( off_t )sector * this->bytesPerSector );
+	else
+		done = preadv( file->fd, vector, iovCount, ( off_t )sector * this->bytesPerSector );
+
+	if( done == expected )
+		return 0;
+
+	/* a short or interrupted transfer is finished segment by segment */
+	for( i = 0; i < iovCount; i++ )
+	{
+		if( disksim_file_transfer( this, write, sector, iov[i].count, ( char* )iov[i].buffer ) )
+			return -1;
+		sector += iov[i].count;
+	}
 
 	return 0;
 }
 
+int disksim_file_read_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	return disksim_file_transfer_v( this, 0, sector, iov, iovCount );
+}
+
+int disksim_file_write_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	return disksim_file_transfer_v( this, 1, sector, iov, iovCount );
+}
+
+int disksim_file_flush( DISK_OPERATIONS* this )
+{
+	return fdatasync( ( ( DISK_FILE* )this->pdata )->fd );
+}
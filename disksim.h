@@ -15,6 +15,11 @@
 #include "common.h"
 
 int disksim_init( SECTOR, unsigned int, DISK_OPERATIONS* );
+int disksim_init_file( const char*, SECTOR, unsigned int, DISK_OPERATIONS* );
+
+#define DISKSIM_DIRECT			0x01	/* bypass the page cache with O_DIRECT */
+
+int disksim_init_fd( const char*, SECTOR, unsigned int, int, DISK_OPERATIONS* );
 void disksim_uninit( DISK_OPERATIONS* );
 
 #endif
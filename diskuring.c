@@ -0,0 +1,429 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskuring.c                                                      */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Image file disk driven by io_uring                               */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <memory.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "diskuring.h"
+
+#define MAX_REQUEST_IOVEC		8
+
+#define MAX( a, b )				( ( a ) > ( b ) ? ( a ) : ( b ) )
+
+/* a submission slot, its vector has to stay untouched until the request completes */
+typedef struct
+{
+	DISK_REQUEST*	request;
+	size_t			expected;
+	struct iovec	vector[MAX_REQUEST_IOVEC];
+} URING_SLOT;
+
+typedef struct
+{
+	int					fd;
+	int					ringFd;
+	unsigned int		depth;
+
+	unsigned int*		sqHead;
+	unsigned int*		sqTail;
+	unsigned int*		sqMask;
+	unsigned int*		sqArray;
+	struct io_uring_sqe*	sqes;
+
+	unsigned int*		cqHead;
+	unsigned int*		cqTail;
+	unsigned int*		cqMask;
+	struct io_uring_cqe*	cqes;
+
+	void*				sqRing;
+	size_t				sqRingSize;
+	void*				cqRing;
+	size_t				cqRingSize;
+	size_t				sqesSize;
+
+	URING_SLOT*			slots;
+	unsigned int*		freeSlots;		/* stack of unused slot numbers */
+	unsigned int		freeCount;
+} DISK_URING;
+
+int diskuring_read( DISK_OPERATIONS* this, SECTOR sector, void* data );
+int diskuring_write( DISK_OPERATIONS* this, SECTOR sector, const void* data );
+int diskuring_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data );
+int diskuring_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data );
+int diskuring_read_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount );
+int diskuring_write_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount );
+int diskuring_flush( DISK_OPERATIONS* this );
+int diskuring_submit( DISK_OPERATIONS* this, DISK_REQUEST* requests, int count );
+int diskuring_complete( DISK_OPERATIONS* this, int minimum );
+
+int io_uring_setup( unsigned int entries, struct io_uring_params* params )
+{
+	return ( int )syscall( __NR_io_uring_setup, entries, params );
+}
+
+int io_uring_enter( int ringFd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags )
+{
+	return ( int )syscall( __NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0 );
+}
+
+int diskuring_map_rings( DISK_URING* ring, struct io_uring_params* params )
+{
+	char*	sq;
+	char*	cq;
+
+	ring->sqRingSize = params->sq_off.array + params->sq_entries * sizeof( unsigned int );
+	ring->cqRingSize = params->cq_off.cqes + params->cq_entries * sizeof( struct io_uring_cqe );
+
+	/* newer kernels share one mapping between both rings */
+	if( params->features & IORING_FEAT_SINGLE_MMAP )
+		ring->sqRingSize = ring->cqRingSize = MAX( ring->sqRingSize, ring->cqRingSize );
+
+	ring->sqRing = mmap( NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQ_RING );
+	if( ring->sqRing == MAP_FAILED )
+	{
+		ring->sqRing = NULL;
+		return -1;
+	}
+
+	if( params->features & IORING_FEAT_SINGLE_MMAP )
+		ring->cqRing = ring->sqRing;
+	else
+	{
+		ring->cqRing = mmap( NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_CQ_RING );
+		if( ring->cqRing == MAP_FAILED )
+		{
+			ring->cqRing = NULL;
+			return -1;
+		}
+	}
+
+	ring->sqesSize = params->sq_entries * sizeof( struct io_uring_sqe );
+	ring->sqes = mmap( NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQES );
+	if( ring->sqes == MAP_FAILED )
+	{
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	sq = ( char* )ring->sqRing;
+	cq = ( char* )ring->cqRing;
+
+	ring->sqHead	= ( unsigned int* )( sq + params->sq_off.head );
+	ring->sqTail	= ( unsigned int* )( sq + params->sq_off.tail );
+	ring->sqMask	= ( unsigned int* )( sq + params->sq_off.ring_mask );
+	ring->sqArray	= ( unsigned int* )( sq + params->sq_off.array );
+	ring->cqHead	= ( unsigned int* )( cq + params->cq_off.head );
+	ring->cqTail	= ( unsigned int* )( cq + params->cq_off.tail );
+	ring->cqMask	= ( unsigned int* )( cq + params->cq_off.ring_mask );
+	ring->cqes		= ( struct io_uring_cqe* )( cq + params->cq_off.cqes );
+
+	return 0;
+}
+
+/* Opens an image file whose sectors are transferred through an io_uring of the given depth.
+ * A new or empty file is sized to numberOfSectors, an existing image keeps its own size */
+int diskuring_init( const char* path, SECTOR numberOfSectors, unsigned int bytesPerSector, unsigned int depth, DISK_OPERATIONS* disk )
+{
+	DISK_URING*				ring;
+	struct io_uring_params	params;
+	struct stat				st;
+	unsigned int			i;
+
+	if( disk == NULL || path == NULL )
+		return -1;
+
+	disk->pdata = calloc( 1, sizeof( DISK_URING ) );
+	if( disk->pdata == NULL )
+		return -1;
+
+	ring = ( DISK_URING* )disk->pdata;
+	ring->ringFd = -1;
+	ring->fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( ring->fd < 0 || fstat( ring->fd, &st ) )
+	{
+		diskuring_uninit( disk );
+		return -1;
+	}
+
+	if( st.st_size < bytesPerSector )
+	{
+		if( ftruncate( ring->fd, ( off_t )bytesPerSector * numberOfSectors ) )
+		{
+			diskuring_uninit( disk );
+			return -1;
+		}
+	}
+	else
+		numberOfSectors = st.st_size / bytesPerSector;
+
+	ZeroMemory( &params, sizeof( params ) );
+	ring->ringFd = io_uring_setup( depth, &params );
+	if( ring->ringFd < 0 || diskuring_map_rings( ring, &params ) )
+	{
+		diskuring_uninit( disk );
+		return -1;
+	}
+
+	/* the completion queue is at least as deep as the submission queue, so slots bound both */
+	ring->depth		= params.sq_entries;
+	ring->slots		= ( URING_SLOT* )calloc( ring->depth, sizeof( URING_SLOT ) );
+	ring->freeSlots	= ( unsigned int* )malloc( ring->depth * sizeof( unsigned int ) );
+	if( ring->slots == NULL || ring->freeSlots == NULL )
+	{
+		diskuring_uninit( disk );
+		return -1;
+	}
+
+	for( i = 0; i < ring->depth; i++ )
+		ring->freeSlots[i] = i;
+	ring->freeCount = ring->depth;
+
+	disk->read_sector	= diskuring_read;
+	disk->write_sector	= diskuring_write;
+	disk->read_sectors	= diskuring_read_sectors;
+	disk->write_sectors	= diskuring_write_sectors;
+	disk->read_sectors_v	= diskuring_read_sectors_v;
+	disk->write_sectors_v	= diskuring_write_sectors_v;
+	disk->flush			= diskuring_flush;
+	disk->submit		= diskuring_submit;
+	disk->complete		= diskuring_complete;
+	disk->numberOfSectors	= numberOfSectors;
+	disk->bytesPerSector	= bytesPerSector;
+
+	return 0;
+}
+
+void diskuring_uninit( DISK_OPERATIONS* this )
+{
+	DISK_URING*	ring;
+
+	if( this == NULL || this->pdata == NULL )
+		return;
+
+	ring = ( DISK_URING* )this->pdata;
+
+	/* nothing may still be in flight when the rings go away */
+	if( ring->slots && ring->freeCount < ring->depth )
+		diskuring_complete( this, ring->depth - ring->freeCount );
+
+	if( ring->sqes )
+		munmap( ring->sqes, ring->sqesSize );
+	if( ring->cqRing && ring->cqRing != ring->sqRing )
+		munmap( ring->cqRing, ring->cqRingSize );
+	if( ring->sqRing )
+		munmap( ring->sqRing, ring->sqRingSize );
+	if( ring->ringFd >= 0 )
+		close( ring->ringFd );
+	if( ring->fd >= 0 )
+	{
+		fdatasync( ring->fd );
+		close( ring->fd );
+	}
+
+	free( ring->slots );
+	free( ring->freeSlots );
+	free( this->pdata );
+	this->pdata = NULL;
+}
+
+int diskuring_submit( DISK_OPERATIONS* this, DISK_REQUEST* requests, int count )
+{
+	DISK_URING*				ring = ( DISK_URING* )this->pdata;
+	struct io_uring_sqe*	sqe;
+	URING_SLOT*				slot;
+	unsigned int			tail, index, slotNumber;
+	UINT32					sectors;
+	int						i, j, queued = 0, submitted, failed = 0;
+
+	tail = *ring->sqTail;
+
+	for( i = 0; i < count && ring->freeCount > 0; i++ )
+	{
+		if( requests[i].iovCount > MAX_REQUEST_IOVEC )
+		{
+			requests[i].result = -EINVAL;
+			break;
+		}
+
+		slotNumber = ring->freeSlots[--ring->freeCount];
+		slot = &ring->slots[slotNumber];
+		slot->request = &requests[i];
+		slot->expected = 0;
+
+		sectors = 0;
+		for( j = 0; j < requests[i].iovCount; j++ )
+		{
+			slot->vector[j].iov_base	= requests[i].iov[j].buffer;
+			slot->vector[j].iov_len		= ( size_t )requests[i].iov[j].count * this->bytesPerSector;
+			slot->expected += slot->vector[j].iov_len;
+			sectors += requests[i].iov[j].count;
+		}
+
+		if( requests[i].sector >= this->numberOfSectors || sectors > this->numberOfSectors - requests[i].sector )
+		{
+			ring->freeSlots[ring->freeCount++] = slotNumber;
+			requests[i].result = -EINVAL;
+			break;
+		}
+
+		index = tail & *ring->sqMask;
+		sqe = &ring->sqes[index];
+		ZeroMemory( sqe, sizeof( struct io_uring_sqe ) );
+		sqe->opcode		= ( requests[i].write ? IORING_OP_WRITEV : IORING_OP_READV );
+		sqe->fd			= ring->fd;
+		sqe->off		= ( __u64 )requests[i].sector * this->bytesPerSector;
+		sqe->addr		= ( __u64 )( size_t )slot->vector;
+		sqe->len		= requests[i].iovCount;
+		sqe->user_data	= slotNumber;
+
+		ring->sqArray[index] = index;
+		requests[i].result = DISK_REQUEST_PENDING;
+		tail++;
+		queued++;
+	}
+
+	if( queued == 0 )
+		return ( i < count && requests[i].result < 0 ? -1 : 0 );
+
+	__atomic_store_n( ring->sqTail, tail, __ATOMIC_RELEASE );
+
+	while( ( submitted = io_uring_enter( ring->ringFd, queued, 0, 0 ) ) < 0 && errno == EINTR )
+		;
+
+	/* a busy ring takes nothing until completions are reaped, other errors fail the submission */
+	if( submitted < 0 )
+	{
+		failed = ( errno != EAGAIN && errno != EBUSY );
+		submitted = 0;
+	}
+
+	/* requests the kernel did not take leave the queue and their slots, they are submitted again */
+	for( ; queued > submitted; queued-- )
+	{
+		index = --tail & *ring->sqMask;
+		ring->freeSlots[ring->freeCount++] = ( unsigned int )ring->sqes[index].user_data;
+	}
+	__atomic_store_n( ring->sqTail, tail, __ATOMIC_RELEASE );
+
+	/* with no request in flight no completion can make room for a retry */
+	if( failed || ( submitted == 0 && ring->freeCount == ring->depth ) )
+		return -1;
+
+	return submitted;
+}
+
+int diskuring_complete( DISK_OPERATIONS* this, int minimum )
+{
+	DISK_URING*				ring = ( DISK_URING* )this->pdata;
+	struct io_uring_cqe*	cqe;
+	URING_SLOT*				slot;
+	unsigned int			head, tail;
+	int						reaped = 0;
+
+	if( minimum > ( int )( ring->depth - ring->freeCount ) )
+		minimum = ring->depth - ring->freeCount;
+
+	do
+	{
+		head = *ring->cqHead;
+		tail = __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE );
+
+		while( head != tail )
+		{
+			cqe = &ring->cqes[head & *ring->cqMask];
+			slot = &ring->slots[cqe->user_data];
+
+			/* a short transfer can only happen at the end of the image */
+			if( cqe->res < 0 )
+				slot->request->result = cqe->res;
+			else if( ( size_t )cqe->res != slot->expected )
+				slot->request->result = -EIO;
+			else
+				slot->request->result = 0;
+
+			ring->freeSlots[ring->freeCount++] = ( unsigned int )cqe->user_data;
+			head++;
+			reaped++;
+		}
+
+		__atomic_store_n( ring->cqHead, head, __ATOMIC_RELEASE );
+
+		if( reaped >= minimum )
+			break;
+
+		if( io_uring_enter( ring->ringFd, 0, minimum - reaped, IORING_ENTER_GETEVENTS ) < 0 && errno != EINTR )
+			return -1;
+	} while( -1 );
+
+	return reaped;
+}
+
+int diskuring_transfer( DISK_OPERATIONS* this, int write, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	DISK_REQUEST	request;
+
+	request.write		= write;
+	request.sector		= sector;
+	request.iov			= iov;
+	request.iovCount	= iovCount;
+
+	return disk_transfer_requests( this, &request, 1 );
+}
+
+int diskuring_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	DISK_IOVEC	iov = { data, 1 };
+
+	return diskuring_transfer( this, 0, sector, &iov, 1 );
+}
+
+int diskuring_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	DISK_IOVEC	iov = { ( void* )data, 1 };
+
+	return diskuring_transfer( this, 1, sector, &iov, 1 );
+}
+
+int diskuring_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	DISK_IOVEC	iov = { data, count };
+
+	return diskuring_transfer( this, 0, sector, &iov, 1 );
+}
+
+int diskuring_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	DISK_IOVEC	iov = { ( void* )data, count };
+
+	return diskuring_transfer( this, 1, sector, &iov, 1 );
+}
+
+int diskuring_read_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	return diskuring_transfer( this, 0, sector, iov, iovCount );
+}
+
+int diskuring_write_sectors_v( DISK_OPERATIONS* this, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	return diskuring_transfer( this, 1, sector, iov, iovCount );
+}
+
+int diskuring_flush( DISK_OPERATIONS* this )
+{
+	return fdatasync( ( ( DISK_URING* )this->pdata )->fd );
+}
@@ -0,0 +1,23 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskuring.h                                                      */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : io_uring disk header                                             */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DISKURING_H_
+#define _DISKURING_H_
+
+#include "common.h"
+#include "disk.h"
+
+#define DISKURING_QUEUE_DEPTH	64
+
+int diskuring_init( const char*, SECTOR, unsigned int, unsigned int, DISK_OPERATIONS* );
+void diskuring_uninit( DISK_OPERATIONS* );
+
+#endif
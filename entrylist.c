@@ -22,11 +22,23 @@ int init_entry_list( SHELL_ENTRY_LIST* list )
 	return 0;
 }
 
-int add_entry_list( SHELL_ENTRY_LIST* list, SHELL_ENTRY* entry )
+int add_entry_list( SHELL_ENTRY_LIST* list, const SHELL_DIR_ENTRY* entry )
 {
+	SHELL_ENTRY_BLOCK*		block = list->blocks;
 	SHELL_ENTRY_LIST_ITEM*	newItem;
 
-	newItem = ( SHELL_ENTRY_LIST_ITEM* )malloc( sizeof( SHELL_ENTRY_LIST_ITEM ) );
+	if( block == NULL || block->used == SHELL_ENTRY_BLOCK_ITEMS )
+	{
+		block = ( SHELL_ENTRY_BLOCK* )malloc( sizeof( SHELL_ENTRY_BLOCK ) );
+		if( block == NULL )
+			return -1;
+
+		block->used		= 0;
+		block->next		= list->blocks;
+		list->blocks	= block;
+	}
+
+	newItem = &block->items[block->used++];
 	newItem->entry	= *entry;
 	newItem->next	= NULL;
 
@@ -45,23 +57,16 @@ int add_entry_list( SHELL_ENTRY_LIST* list, SHELL_ENTRY* entry )
 
 void release_entry_list( SHELL_ENTRY_LIST* list )
 {
-	SHELL_ENTRY_LIST_ITEM*	currentItem;
-	SHELL_ENTRY_LIST_ITEM*	nextItem;
+	SHELL_ENTRY_BLOCK*	block;
 
-	if( list->count == 0 )
-		return;
-
-	nextItem = list->first;
-
-	do
+	while( list->blocks )
 	{
-		currentItem = nextItem;
-		nextItem = currentItem->next;
-		free( currentItem );
-	} while( nextItem );
+		block = list->blocks;
+		list->blocks = block->next;
+		free( block );
+	}
 
 	list->count	= 0;
 	list->first	= NULL;
 	list->last	= NULL;
 }
-
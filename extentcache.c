@@ -0,0 +1,146 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : extentcache.c                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Cluster extent cache                                             */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "common.h"
+#include "extentcache.h"
+
+#define EXTENT_MAP_INITIAL_SIZE		8
+
+void init_extent_cache( EXTENT_CACHE* cache )
+{
+	ZeroMemory( cache, sizeof( EXTENT_CACHE ) );
+}
+
+void release_extent_cache( EXTENT_CACHE* cache )
+{
+	UINT32	i;
+
+	for( i = 0; i < EXTENT_CACHE_FILES; i++ )
+		free( cache->maps[i].extents );
+
+	ZeroMemory( cache, sizeof( EXTENT_CACHE ) );
+}
+
+/* Returns the map of the chain starting at firstCluster, the least recently used map is
+ * emptied for it when the chain is not cached */
+EXTENT_MAP* get_extent_map( EXTENT_CACHE* cache, SECTOR firstCluster )
+{
+	EXTENT_MAP*	victim = &cache->maps[0];
+	UINT32		i;
+
+	cache->clock++;
+
+	for( i = 0; i < EXTENT_CACHE_FILES; i++ )
+	{
+		if( cache->maps[i].valid && cache->maps[i].firstCluster == firstCluster )
+		{
+			cache->maps[i].lastUsed = cache->clock;
+			cache->hits++;
+			return &cache->maps[i];
+		}
+
+		if( cache->maps[i].lastUsed < victim->lastUsed )
+			victim = &cache->maps[i];
+	}
+
+	cache->misses++;
+
+	victim->firstCluster	= firstCluster;
+	victim->valid			= 1;
+	victim->clusters		= 0;
+	victim->count			= 0;
+	victim->lastUsed		= cache->clock;
+
+	return victim;
+}
+
+/* Binary search of the extent holding the logical cluster. Returns how many clusters from it
+ * are contiguous on the disk as far as the chain is mapped, 0 when it is not mapped */
+UINT32 find_extent_run( const EXTENT_MAP* map, UINT32 logical, SECTOR* cluster )
+{
+	UINT32	low = 0, high = map->count, middle;
+
+	if( logical >= map->clusters )
+		return 0;
+
+	while( high - low > 1 )
+	{
+		middle = ( low + high ) / 2;
+		if( map->extents[middle].logical <= logical )
+			low = middle;
+		else
+			high = middle;
+	}
+
+	*cluster = map->extents[low].cluster + ( logical - map->extents[low].logical );
+	return map->extents[low].length - ( logical - map->extents[low].logical );
+}
+
+SECTOR get_last_extent_cluster( const EXTENT_MAP* map )
+{
+	const CLUSTER_EXTENT*	last;
+
+	if( map->count == 0 )
+		return 0;
+
+	last = &map->extents[map->count - 1];
+	return last->cluster + last->length - 1;
+}
+
+/* Map the next cluster of the chain, it joins the last extent when it follows it on the disk */
+int add_extent_cluster( EXTENT_MAP* map, SECTOR cluster )
+{
+	CLUSTER_EXTENT*	extents;
+	UINT32			size;
+
+	if( map->count && get_last_extent_cluster( map ) + 1 == cluster )
+	{
+		map->extents[map->count - 1].length++;
+		map->clusters++;
+		return FAT_SUCCESS;
+	}
+
+	if( map->count == map->size )
+	{
+		size	= map->size ? map->size * 2 : EXTENT_MAP_INITIAL_SIZE;
+		extents	= ( CLUSTER_EXTENT* )realloc( map->extents, size * sizeof( CLUSTER_EXTENT ) );
+		if( extents == NULL )
+			return FAT_ERROR;
+
+		map->extents	= extents;
+		map->size		= size;
+	}
+
+	map->extents[map->count].logical	= map->clusters;
+	map->extents[map->count].cluster	= cluster;
+	map->extents[map->count].length		= 1;
+	map->count++;
+	map->clusters++;
+
+	return FAT_SUCCESS;
+}
+
+/* drop the map of a chain that was freed, its clusters may be reused by other chains */
+void invalidate_extent_map( EXTENT_CACHE* cache, SECTOR firstCluster )
+{
+	UINT32	i;
+
+	for( i = 0; i < EXTENT_CACHE_FILES; i++ )
+	{
+		if( cache->maps[i].valid && cache->maps[i].firstCluster == firstCluster )
+		{
+			cache->maps[i].valid		= 0;
+			cache->maps[i].clusters		= 0;
+			cache->maps[i].count		= 0;
+			cache->maps[i].lastUsed		= 0;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : extentcache.h                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Cluster extent cache header                                      */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _EXTENTCACHE_H_
+#define _EXTENTCACHE_H_
+
+#include "common.h"
+
+#define EXTENT_CACHE_FILES		16
+
+/* clusters logical to logical + length - 1 of a file are the physical clusters from cluster */
+typedef struct
+{
+	UINT32			logical;
+	SECTOR			cluster;
+	UINT32			length;
+} CLUSTER_EXTENT;
+
+/* the run-length map of the front of a cluster chain, extended as the file is accessed
+ * further. The chain may have grown past the mapped clusters, so its end is never cached */
+typedef struct
+{
+	SECTOR			firstCluster;
+	BYTE			valid;				/* 0 when the map is unused */
+	UINT32			clusters;			/* clusters mapped */
+	UINT32			count;
+	UINT32			size;
+	UINT32			lastUsed;
+	CLUSTER_EXTENT*	extents;
+} EXTENT_MAP;
+
+/* maps of the files accessed most recently, keyed by their first cluster */
+typedef struct
+{
+	EXTENT_MAP		maps[EXTENT_CACHE_FILES];
+	UINT32			clock;
+	UINT32			hits;
+	UINT32			misses;
+} EXTENT_CACHE;
+
+void		init_extent_cache( EXTENT_CACHE* );
+EXTENT_MAP*	get_extent_map( EXTENT_CACHE*, SECTOR );
+UINT32		find_extent_run( const EXTENT_MAP*, UINT32, SECTOR* );
+SECTOR		get_last_extent_cluster( const EXTENT_MAP* );
+int			add_extent_cluster( EXTENT_MAP*, SECTOR );
+void		invalidate_extent_map( EXTENT_CACHE*, SECTOR );
+void		release_extent_cache( EXTENT_CACHE* );
+
+#endif
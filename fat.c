@@ -10,16 +10,39 @@
 /******************************************************************************/
 
 #include "fat.h"
-#include "clusterlist.h"
+#include "clusterbitmap.h"
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+#include <immintrin.h>
+#endif
 
 #define MIN( a, b )					( ( a ) < ( b ) ? ( a ) : ( b ) )
 #define MAX( a, b )					( ( a ) > ( b ) ? ( a ) : ( b ) )
 #define NO_MORE_CLUSER()			WARNING( "No more clusters are remained\n" );
+#define CLEAR_FAT_SECTORS			16
+#define FAT_IO_BATCH				32
+#define FAT_LOAD_CHUNK				128
+#define FAT_ZERO_SECTORS			128
+#define FAT_ENTRY_BYTES( fs )		( ( fs )->FATType == FAT32 ? 4 : 2 )
+#define FAT_CHUNK_OF( fs, cluster )	( ( cluster ) * FAT_ENTRY_BYTES( fs ) / ( ( fs )->bpb.bytesPerSector * FAT_LOAD_CHUNK ) )
+#define LOCK_FAT( fs )				if( ( fs )->scanning ) pthread_mutex_lock( &( fs )->scanLock )
+#define UNLOCK_FAT( fs )			if( ( fs )->scanning ) pthread_mutex_unlock( &( fs )->scanLock )
+#define IS_FIXED_ROOT( fs, cluster )	( ( cluster ) == 0 && ( ( fs )->FATType == FAT12 || ( fs )->FATType == FAT16 ) )
 
 unsigned char toupper( unsigned char ch );
 int isalpha( unsigned char ch );
 int isdigit( unsigned char ch );
 
+DWORD	get_fat( FAT_FILESYSTEM* fs, SECTOR cluster );
+int		update_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value );
+int		flush_fat( FAT_FILESYSTEM* fs, BYTE mirror );
+int		add_free_clusters( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count );
+int		recover_volume( FAT_FILESYSTEM* fs );
+void	apply_delayed_size( FAT_FILESYSTEM* fs, FAT_NODE* node );
+int		flush_delayed_writes( FAT_FILESYSTEM* fs );
+void	release_delayed_writes( FAT_FILESYSTEM* fs );
+int		read_dir_sector( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, BYTE* sector );
+int		next_dir_sector( FAT_FILESYSTEM* fs, FAT_ENTRY_LOCATION* location );
+
 /* calculate the 'sectors per cluster' by some conditions */
 DWORD get_sector_per_clusterN( DWORD diskTable[][2], UINT64 diskSize, UINT32 bytesPerSector )
 {
@@ -97,7 +120,7 @@ void fill_fat_size( FAT_BPB* bpb, BYTE FATType )
 
 	FATSize = ( tmpVal1 + ( tmpVal2 - 1 ) ) / tmpVal2;
 
-	if( FATType == 32 )
+	if( FATType == FAT32 )
 	{
 		bpb->FATSize16 = 0;
 		bpb->BPB32.FATSize32 = FATSize;
@@ -133,21 +156,21 @@ int fill_bpb( FAT_BPB* bpb, BYTE FATType, SECTOR numberOfSectors, UINT32 bytesPe
 	bpb->bytesPerSector			= bytesPerSector;
 	bpb->sectorsPerCluster		= sectorsPerCluster;
 	bpb->reservedSectorCount	= ( FATType == FAT32 ? 32 : 1 );
-	bpb->numberOfFATs			= 1;
+	bpb->numberOfFATs			= 2;
 	bpb->rootEntryCount			= ( FATType == FAT32 ? 0 : 512 );
 	bpb->totalSectors			= ( numberOfSectors < 0x10000 ? ( UINT16 ) numberOfSectors : 0 );
 
 	bpb->media					= 0xF8;
-	fill_fat_size( bpb, FATType );
 	bpb->sectorsPerTrack		= 0;
 	bpb->numberOfHeads			= 0;
 	bpb->totalSectors32			= ( numberOfSectors >= 0x10000 ? numberOfSectors : 0 );
+	fill_fat_size( bpb, FATType );
 
 	if( FATType == FAT32 )
 	{
 		bpb->BPB32.extFlags		= 0x0081;	/* active FAT : 1, only one FAT is active */
 		bpb->BPB32.FSVersion	= 0;
-//		bpb->BPB32.rootCluster	= 2;
+		bpb->BPB32.rootCluster	= 2;
 		bpb->BPB32.FSInfo		= 1;
 		bpb->BPB32.backupBootSectors	= 6;
 		bpb->BPB32.backupBootSectors	= 0;
@@ -228,14 +251,14 @@ int fill_reserved_fat( FAT_BPB* bpb, BYTE* sector )
 	{
 		shutErrBit12 = ( DWORD* )sector;
 
-		*shutErrBit12 = 0xFF0 << 20;
-		*shutErrBit12 |= ( ( DWORD )bpb->media & 0x0F ) << 20;
-		*shutErrBit12 |= MS_EOC12 << 8;
+		/* FAT[0] = 0xF00 | media, FAT[1] = EOC packed in the first three bytes */
+		*shutErrBit12 = 0xF00 | bpb->media;
+		*shutErrBit12 |= MS_EOC12 << 12;
 	}
 	else if( FATType == FAT16 )
 	{
 		shutBit16 = ( WORD* )sector;
-		errBit16 = ( WORD* )sector + sizeof( WORD );
+		errBit16 = ( WORD* )sector + 1;
 
 		*shutBit16 = 0xFFF0 | bpb->media;
 		*errBit16 = MS_EOC16;
@@ -243,10 +266,13 @@ int fill_reserved_fat( FAT_BPB* bpb, BYTE* sector )
 	else
 	{
 		shutBit32 = ( DWORD* )sector;
-		errBit32 = ( DWORD* )sector + sizeof( DWORD );
+		errBit32 = ( DWORD* )sector + 1;
 
 		*shutBit32 = 0x0FFFFFF0 | bpb->media;
 		*errBit32 = MS_EOC32;
+
+		/* the root directory chain */
+		*( errBit32 + 1 ) = MS_EOC32;
 	}
 
 	return FAT_SUCCESS;
@@ -254,10 +280,10 @@ int fill_reserved_fat( FAT_BPB* bpb, BYTE* sector )
 
 int clear_fat( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 {
-	UINT32	i, end;
+	UINT32	i, end, count;
 	UINT32	FATSize;
 	SECTOR	fatSector;
-	BYTE	sector[MAX_SECTOR_SIZE];
+	BYTE	sector[MAX_SECTOR_SIZE * CLEAR_FAT_SECTORS];
 
 	ZeroMemory( sector, sizeof( sector ) );
 	fatSector = bpb->reservedSectorCount;
@@ -269,13 +295,16 @@ int clear_fat( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 
 	end = fatSector + ( FATSize * bpb->numberOfFATs );
 
-	fill_reserved_fat( bpb, sector );
-	disk->write_sector( disk, fatSector, sector );
-
-	ZeroMemory( sector, sizeof( sector ) );
+	for( i = fatSector; i < end; i += count )
+	{
+		count = MIN( end - i, CLEAR_FAT_SECTORS );
+		disk->write_sectors( disk, i, count, sector );
+	}
 
-	for( i = fatSector + 1; i < end; i++ )
-		disk->write_sector( disk, i, sector );
+	/* every copy starts with the same reserved entries */
+	fill_reserved_fat( bpb, sector );
+	for( i = 0; i < bpb->numberOfFATs; i++ )
+		disk->write_sector( disk, fatSector + i * FATSize, sector );
 
 	return FAT_SUCCESS;
 }
@@ -285,6 +314,7 @@ int create_root( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 	BYTE	sector[MAX_SECTOR_SIZE];
 	SECTOR	rootSector = 0;
 	FAT_DIR_ENTRY*	entry;
+	UINT32	i;
 
 	ZeroMemory( sector, MAX_SECTOR_SIZE );
 	entry = ( FAT_DIR_ENTRY* )sector;
@@ -298,455 +328,1412 @@ int create_root( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 
 	if( get_fat_type( bpb ) == FAT32 )
 	{
-		/* Not implemented yet */
+		/* the root directory is the cluster chain at rootCluster, the first data cluster */
+		rootSector = bpb->reservedSectorCount + ( bpb->numberOfFATs * bpb->BPB32.FATSize32 );
+
+		disk->write_sector( disk, rootSector, sector );
+
+		ZeroMemory( sector, MAX_SECTOR_SIZE );
+		for( i = 1; i < bpb->sectorsPerCluster; i++ )
+			disk->write_sector( disk, rootSector + i, sector );
 	}
 	else
+	{
 		rootSector = bpb->reservedSectorCount + ( bpb->numberOfFATs * bpb->FATSize16 );
-
-	disk->write_sector( disk, rootSector, sector );
+		disk->write_sector( disk, rootSector, sector );
+	}
 
 	return FAT_SUCCESS;
 }
 
-int get_fat_sector( FAT_FILESYSTEM* fs, SECTOR cluster, SECTOR* fatSector, DWORD* fatEntryOffset )
+/* the free count and next free cluster are left unknown, the first mount scans the FAT */
+int create_fsinfo( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 {
-	DWORD	fatOffset;
+	FAT_FSINFO	info;
 
-	switch( fs->FATType )
-	{
-	case FAT32:
-		fatOffset = cluster * 4;
-		break;
-	case FAT16:
-		fatOffset = cluster * 2;
-		break;
-	case FAT12:
-		fatOffset = cluster + ( cluster / 2 );
-		break;
-	default:
-		WARNING( "Illegal file system type\n" );
-		fatOffset = 0;
-		break;
-	}
+	ZeroMemory( &info, sizeof( FAT_FSINFO ) );
 
-	*fatSector		= fs->bpb.reservedSectorCount + ( fatOffset / fs->bpb.bytesPerSector );
-	*fatEntryOffset	= fatOffset % fs->bpb.bytesPerSector;
+	info.leadSignature		= FSINFO_LEAD_SIGNATURE;
+	info.structSignature	= FSINFO_STRUCT_SIGNATURE;
+	info.freeCount			= FSINFO_UNKNOWN;
+	info.nextFree			= FSINFO_UNKNOWN;
+	info.trailSignature		= FSINFO_TRAIL_SIGNATURE;
 
-	return FAT_SUCCESS;
+	return disk->write_sector( disk, bpb->BPB32.FSInfo, &info );
 }
 
-int prepare_fat_sector( FAT_FILESYSTEM* fs, SECTOR cluster, SECTOR* fatSector, DWORD* fatEntryOffset, BYTE* sector )
+/* an odd FAT12 entry is in the upper 12 bits of its WORD, an even one in the lower */
+DWORD decode_fat12_entry( const BYTE* FAT, SECTOR cluster )
 {
-	get_fat_sector( fs, cluster, fatSector, fatEntryOffset );
-	fs->disk->read_sector( fs->disk, *fatSector, sector );
+	return ( *( ( const WORD* )&FAT[cluster + ( cluster / 2 )] ) >> ( ( cluster & 1 ) << 2 ) ) & 0xFFF;
+}
 
-	if( fs->FATType == FAT12 && *fatEntryOffset == fs->bpb.bytesPerSector - 1 )
-	{
-		fs->disk->read_sector( fs->disk, *fatSector + 1, &sector[fs->bpb.bytesPerSector] );
-		return 1;
-	}
+void encode_fat12_entry( BYTE* FAT, SECTOR cluster, DWORD value )
+{
+	WORD*	entry = ( WORD* )&FAT[cluster + ( cluster / 2 )];
+	UINT32	shift = ( cluster & 1 ) << 2;
 
-	return 0;
+	*entry = ( WORD )( ( *entry & ~( 0xFFF << shift ) ) | ( ( value & 0xFFF ) << shift ) );
 }
 
-/* Read a FAT entry from FAT Table */
-DWORD get_fat( FAT_FILESYSTEM* fs, SECTOR cluster )
+DWORD decode_fat16_entry( const BYTE* FAT, SECTOR cluster )
 {
-	BYTE	sector[MAX_SECTOR_SIZE * 2];
-	SECTOR	fatSector;
-	DWORD	fatEntryOffset;
+	return *( ( const WORD* )&FAT[cluster * 2] );
+}
 
-	prepare_fat_sector( fs, cluster, &fatSector, &fatEntryOffset, sector );
+void encode_fat16_entry( BYTE* FAT, SECTOR cluster, DWORD value )
+{
+	*( ( WORD* )&FAT[cluster * 2] ) = ( WORD )value;
+}
 
-	switch( fs->FATType )
-	{
-	case FAT32:
-		return ( *( ( DWORD* )&sector[fatEntryOffset] ) ) & 0xFFFFFFF;
-	case FAT16:
-		return ( DWORD )( *( ( WORD *)&sector[fatEntryOffset] ) );
-	case FAT12:
-		if( cluster & 1 )	/* Cluster number is ODD	*/
-			return ( DWORD )( *( ( WORD *)&sector[fatEntryOffset] ) >> 4 );
-		else				/* Cluster number is EVEN	*/
-			return ( DWORD )( *( ( WORD *)&sector[fatEntryOffset] ) & 0xFFF );
-	}
+/* the upper 4 bits of a FAT32 entry are reserved and kept as they are */
+DWORD decode_fat32_entry( const BYTE* FAT, SECTOR cluster )
+{
+	return *( ( const DWORD* )&FAT[cluster * 4] ) & 0x0FFFFFFF;
+}
 
-	return FAT_ERROR;
+void encode_fat32_entry( BYTE* FAT, SECTOR cluster, DWORD value )
+{
+	DWORD*	entry = ( DWORD* )&FAT[cluster * 4];
+
+	*entry = ( *entry & 0xF0000000 ) | ( value & 0x0FFFFFFF );
 }
 
-/* Write a FAT entry to FAT Table */
-int set_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value )
+/* indexed by FATType */
+const FAT_TYPE_OPERATIONS g_FATTypes[] =
 {
-	BYTE	sector[MAX_SECTOR_SIZE * 2];
-	SECTOR	fatSector;
-	DWORD	fatEntryOffset;
-	int		result;
+	{ decode_fat12_entry, encode_fat12_entry, 3, 0x0FFF, EOC12, MS_EOC12 },
+	{ decode_fat16_entry, encode_fat16_entry, 4, 0xFFFF, EOC16, MS_EOC16 },
+	{ decode_fat32_entry, encode_fat32_entry, 8, 0x0FFFFFFF, EOC32, MS_EOC32 }
+};
+
+/* Decode one entry from the in-memory copy of the FAT */
+DWORD decode_fat_entry( FAT_FILESYSTEM* fs, SECTOR cluster )
+{
+	return fs->type->decode_entry( fs->FATBuffer, cluster );
+}
 
-	result = prepare_fat_sector( fs, cluster, &fatSector, &fatEntryOffset, sector );
+/* Decode the 32 entries of a group starting at cluster, a multiple of 32, into FATEntries.
+ * Returns a mask with a bit set for every free entry of the group */
+UINT32 decode_fat_group( FAT_FILESYSTEM* fs, SECTOR cluster )
+{
+	DWORD*	entries = &fs->FATEntries[cluster];
+	UINT32	mask = 0;
+	int		i;
 
 	switch( fs->FATType )
 	{
 	case FAT32:
-		value &= 0x0FFFFFFF;
-		*( ( DWORD* )&sector[fatEntryOffset] ) &= 0xF0000000;
-		*( ( DWORD* )&sector[fatEntryOffset] ) |= value;
+	{
+		const DWORD*	raw = ( const DWORD* )&fs->FATBuffer[cluster * 4];
+#if defined( __AVX2__ )
+		const __m256i	valueMask = _mm256_set1_epi32( 0x0FFFFFFF );
+		__m256i			values;
+
+		for( i = 0; i < 32; i += 8 )
+		{
+			values = _mm256_and_si256( _mm256_loadu_si256( ( const __m256i* )&raw[i] ), valueMask );
+			_mm256_storeu_si256( ( __m256i* )&entries[i], values );
+			mask |= ( UINT32 )_mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( values, _mm256_setzero_si256() ) ) ) << i;
+		}
+#elif defined( __SSE2__ )
+		const __m128i	valueMask = _mm_set1_epi32( 0x0FFFFFFF );
+		__m128i			values;
+
+		for( i = 0; i < 32; i += 4 )
+		{
+			values = _mm_and_si128( _mm_loadu_si128( ( const __m128i* )&raw[i] ), valueMask );
+			_mm_storeu_si128( ( __m128i* )&entries[i], values );
+			mask |= ( UINT32 )_mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( values, _mm_setzero_si128() ) ) ) << i;
+		}
+#else
+		for( i = 0; i < 32; i++ )
+		{
+			entries[i] = raw[i] & 0x0FFFFFFF;
+			mask |= ( UINT32 )( entries[i] == FREE_CLUSTER ) << i;
+		}
+#endif
 		break;
+	}
 	case FAT16:
-		*( ( WORD* )&sector[fatEntryOffset] ) = ( WORD )value;
-		break;
-	case FAT12:
-		if( cluster & 1 )
+	{
+		const WORD*		raw = ( const WORD* )&fs->FATBuffer[cluster * 2];
+#if defined( __AVX2__ )
+		__m256i			values;
+
+		for( i = 0; i < 32; i += 8 )
 		{
-			value <<= 4;
-			*( ( WORD* )&sector[fatEntryOffset] ) &= 0x000F;
+			values = _mm256_cvtepu16_epi32( _mm_loadu_si128( ( const __m128i* )&raw[i] ) );
+			_mm256_storeu_si256( ( __m256i* )&entries[i], values );
+			mask |= ( UINT32 )_mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( values, _mm256_setzero_si256() ) ) ) << i;
 		}
-		else
+#elif defined( __SSE2__ )
+		const __m128i	zero = _mm_setzero_si128();
+		__m128i			values, free;
+
+		for( i = 0; i < 32; i += 8 )
 		{
-			value &= 0x0FFF;
-			*( ( WORD* )&sector[fatEntryOffset] ) &= 0xF000;
+			values = _mm_loadu_si128( ( const __m128i* )&raw[i] );
+			_mm_storeu_si128( ( __m128i* )&entries[i], _mm_unpacklo_epi16( values, zero ) );
+			_mm_storeu_si128( ( __m128i* )&entries[i + 4], _mm_unpackhi_epi16( values, zero ) );
+
+			/* narrow the 16 bit compare results to bytes to get one mask bit per entry */
+			free = _mm_cmpeq_epi16( values, zero );
+			mask |= ( UINT32 )( _mm_movemask_epi8( _mm_packs_epi16( free, zero ) ) & 0xFF ) << i;
+		}
+#else
+		for( i = 0; i < 32; i++ )
+		{
+			entries[i] = raw[i];
+			mask |= ( UINT32 )( entries[i] == FREE_CLUSTER ) << i;
 		}
-		*( ( WORD* )&sector[fatEntryOffset] ) |= ( WORD )value;
+#endif
 		break;
 	}
+	default:
+	{
+		/* two packed 12 bit entries in every three bytes */
+		const BYTE*		raw = &fs->FATBuffer[cluster + ( cluster / 2 )];
 
-	fs->disk->write_sector( fs->disk, fatSector, sector );
-	if( result )
-		fs->disk->write_sector( fs->disk, fatSector + 1, &sector[fs->bpb.bytesPerSector] );
+		for( i = 0; i < 32; i += 2, raw += 3 )
+		{
+			entries[i]		= raw[0] | ( ( DWORD )( raw[1] & 0x0F ) << 8 );
+			entries[i + 1]	= ( raw[1] >> 4 ) | ( ( DWORD )raw[2] << 4 );
+			mask |= ( UINT32 )( entries[i] == FREE_CLUSTER ) << i;
+			mask |= ( UINT32 )( entries[i + 1] == FREE_CLUSTER ) << ( i + 1 );
+		}
+		break;
+	}
+	}
 
-	return FAT_SUCCESS;
+	return mask;
 }
 
-/******************************************************************************/
-/* Format disk as a specified file system                                     */
-/******************************************************************************/
-int fat_format( DISK_OPERATIONS* disk, BYTE FATType )
+/* Hand the free entries of a decoded group to the allocator, clusters 0 and 1 and the entries
+ * past the last data cluster are not allocatable */
+void add_free_group( FAT_FILESYSTEM* fs, SECTOR cluster, UINT32 mask )
 {
-	FAT_BPB bpb;
-
-	if( fill_bpb( &bpb, FATType, disk->numberOfSectors, disk->bytesPerSector ) != FAT_SUCCESS ) // bpb ʱȭ
-		return FAT_ERROR;
-
-	disk->write_sector( disk, 0, &bpb );
-
-	PRINTF( "bytes per sector       : %u\n", bpb.bytesPerSector );
-	PRINTF( "sectors per cluster    : %u\n", bpb.sectorsPerCluster );
-	PRINTF( "number of FATs         : %u\n", bpb.numberOfFATs );
-	PRINTF( "root entry count       : %u\n", bpb.rootEntryCount );
-	PRINTF( "total sectors          : %u\n", ( bpb.totalSectors ? bpb.totalSectors : bpb.totalSectors32 ) );
-	PRINTF( "\n" );
-
-	clear_fat( disk, &bpb ); // FAT ̺ ʱȭ
-	create_root( disk, &bpb ); // root 丮  + ʱȭ
+	if( cluster == 0 )
+		mask &= ~3U;
+	if( cluster + BITS_PER_WORD > fs->freeClusters.clusters )
+		mask &= cluster < fs->freeClusters.clusters ? ( 1U << ( fs->freeClusters.clusters - cluster ) ) - 1 : 0;
 
-	return FAT_SUCCESS;
+	set_cluster_word_free( &fs->freeClusters, cluster / BITS_PER_WORD, mask );
 }
 
-int validate_bpb( FAT_BPB* bpb )
+UINT32 get_count_of_clusters( FAT_FILESYSTEM* fs )
 {
-	int FATType;
+	UINT32	totalSectors, dataSector, rootSector;
 
-	if( !( bpb->jmpBoot[0] == 0xEB && bpb->jmpBoot[2] == 0x90 ) &&
-		!( bpb->jmpBoot[0] == 0xE9 ) )
-		return FAT_ERROR;
+	rootSector = ( ( fs->bpb.rootEntryCount * 32 ) + ( fs->bpb.bytesPerSector - 1 ) ) / fs->bpb.bytesPerSector;
 
-	FATType = get_fat_type( bpb );
+	if( fs->bpb.totalSectors != 0 )
+		totalSectors = fs->bpb.totalSectors;
+	else
+		totalSectors = fs->bpb.totalSectors32;
 
-	if( FATType < 0 )
-		return FAT_ERROR;
+	dataSector = totalSectors - ( fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->FATSize ) + rootSector );
 
-	return FAT_SUCCESS;
+	return dataSector / fs->bpb.sectorsPerCluster;
 }
 
-/* when FAT type is FAT12 or FAT16 */
-int read_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, BYTE* sector )
+void load_fat_entry( FAT_FILESYSTEM* fs, SECTOR cluster )
 {
-	SECTOR	rootSector;
-
-	rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 );
-
-	return fs->disk->read_sector( fs->disk, rootSector + sectorNumber, sector );
+	fs->FATEntries[cluster] = decode_fat_entry( fs, cluster );
+	if( fs->FATEntries[cluster] == FREE_CLUSTER && cluster >= 2 && cluster < fs->freeClusters.clusters )
+		set_cluster_free( &fs->freeClusters, cluster );
 }
 
-int write_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, const BYTE* sector )
+/* Decode one chunk of a FAT16/32 FAT read into FATBuffer. A chunk always holds whole groups */
+void decode_fat_chunk( FAT_FILESYSTEM* fs, UINT32 chunk )
 {
-	SECTOR	rootSector;
-
-	rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 );
-
-	return fs->disk->write_sector( fs->disk, rootSector + sectorNumber, sector );
+	SECTOR	first = chunk * FAT_LOAD_CHUNK;
+	UINT32	count = MIN( fs->FATSize - first, FAT_LOAD_CHUNK );
+	UINT32	freeCount = fs->freeClusters.count;
+	DWORD	cluster, end;
+
+	cluster	= first * fs->bpb.bytesPerSector / FAT_ENTRY_BYTES( fs );
+	end		= MIN( ( first + count ) * fs->bpb.bytesPerSector / FAT_ENTRY_BYTES( fs ), fs->FATEntryCount );
+
+	for( ; cluster + 32 <= end; cluster += 32 )
+		add_free_group( fs, cluster, decode_fat_group( fs, cluster ) );
+	for( ; cluster < end; cluster++ )
+		load_fat_entry( fs, cluster );
+
+	/* a trusted FSInfo already counted the free clusters of the chunks not loaded */
+	if( !fs->freeCountKnown )
+		fs->info32.freeCount += fs->freeClusters.count - freeCount;
+
+	fs->FATChunksLoaded[chunk] = 1;
+	if( --fs->FATChunksLeft == 0 )
+		fs->freeCountKnown = 1;
 }
 
-/* Translate logical cluster and sector numbers to a physical sector number */
-SECTOR	calc_physical_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber )
+/* Load one chunk of a FAT16/32 FAT that was skipped at mount */
+int load_fat_chunk( FAT_FILESYSTEM* fs, UINT32 chunk )
 {
-	SECTOR	firstDataSector;
-	SECTOR	firstSectorOfCluster;
-	SECTOR	rootDirSectors;
+	SECTOR	first = chunk * FAT_LOAD_CHUNK;
+	UINT32	count = MIN( fs->FATSize - first, FAT_LOAD_CHUNK );
 
-	rootDirSectors = ( ( fs->bpb.rootEntryCount * 32 ) + ( fs->bpb.bytesPerSector - 1 ) ) / fs->bpb.bytesPerSector ;
-	firstDataSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->FATSize ) + rootDirSectors;
-	firstSectorOfCluster = ( ( clusterNumber - 2 ) * fs->bpb.sectorsPerCluster ) + firstDataSector;
+	if( fs->FATChunksLoaded[chunk] )
+		return FAT_SUCCESS;
 
-	return firstSectorOfCluster + sectorNumber;
-}
+	if( fs->disk->read_sectors( fs->disk, fs->bpb.reservedSectorCount + first, count,
+			&fs->FATBuffer[first * fs->bpb.bytesPerSector] ) )
+		return FAT_ERROR;
 
-int read_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, BYTE* sector )
-{
-	return fs->disk->read_sector( fs->disk, calc_physical_sector( fs, clusterNumber, sectorNumber ), sector );
-}
+	decode_fat_chunk( fs, chunk );
 
-int write_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, const BYTE* sector )
-{
-	return fs->disk->write_sector( fs->disk, calc_physical_sector( fs, clusterNumber, sectorNumber ), sector );
+	return FAT_SUCCESS;
 }
 
-/* search free clusters from FAT and add to free cluster list */
-int search_free_clusters( FAT_FILESYSTEM* fs )
+/* Make sure the entry of a cluster is loaded before it is read or changed */
+int prepare_fat_entry( FAT_FILESYSTEM* fs, SECTOR cluster )
 {
-	UINT32	totalSectors, dataSector, rootSector, countOfClusters, FATSize;
-	UINT32	i, cluster;
+	int		result = FAT_SUCCESS;
 
-	rootSector = ( ( fs->bpb.rootEntryCount * 32 ) + ( fs->bpb.bytesPerSector - 1 ) ) / fs->bpb.bytesPerSector;
+	LOCK_FAT( fs );
+	if( fs->FATChunksLeft )
+		result = load_fat_chunk( fs, FAT_CHUNK_OF( fs, cluster ) );
+	UNLOCK_FAT( fs );
 
-	if( fs->bpb.FATSize16 != 0 )
-		FATSize = fs->bpb.FATSize16;
-	else
-		FATSize = fs->bpb.BPB32.FATSize32;
+	return result;
+}
 
-	if( fs->bpb.totalSectors != 0 )
-		totalSectors = fs->bpb.totalSectors;
-	else
-		totalSectors = fs->bpb.totalSectors32;
+/* Load the first chunk not loaded yet at or after the allocation hint, so the allocator
+ * sees more free clusters. Fails when the whole FAT is loaded */
+int load_next_fat_chunk( FAT_FILESYSTEM* fs )
+{
+	UINT32	i, chunk;
 
-	dataSector = totalSectors - ( fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * FATSize ) + rootSector );
-	countOfClusters = dataSector / fs->bpb.sectorsPerCluster;
+	if( fs->FATChunksLeft == 0 )
+		return FAT_ERROR;
 
-	for( i = 2; i < countOfClusters; i++ )
+	chunk = FAT_CHUNK_OF( fs, fs->freeClusters.hint );
+	for( i = 0; i < fs->FATChunkCount; i++ )
 	{
-		cluster = get_fat( fs, i );
-		if( cluster == FREE_CLUSTER )
-			add_free_cluster( fs, i );
+		if( !fs->FATChunksLoaded[( chunk + i ) % fs->FATChunkCount] )
+			return load_fat_chunk( fs, ( chunk + i ) % fs->FATChunkCount );
 	}
 
-	return FAT_SUCCESS;
+	return FAT_ERROR;
 }
 
-int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root )
+/* FAT16 and FAT32 keep the clean bit in FAT[1]. FAT12 entries have no room for it, so bit 0
+ * of the reserved byte of the boot sector is used like Windows NT does, set while dirty */
+int is_volume_clean( FAT_FILESYSTEM* fs )
 {
-	INT		result;
-	BYTE	sector[MAX_SECTOR_SIZE];
-
-	if( fs == NULL || fs->disk == NULL )
+	switch( fs->FATType )
 	{
-		WARNING( "DISK_OPERATIONS : %p\nFAT_FILESYSTEM : %p\n", fs, fs->disk );
-		return FAT_ERROR;
+	case FAT32:
+		return ( get_fat( fs, 1 ) & SHUT_BIT_MASK32 ) != 0;
+	case FAT16:
+		return ( get_fat( fs, 1 ) & SHUT_BIT_MASK16 ) != 0;
+	default:
+		return !( fs->bpb.bs.reserved1 & VOLUME_DIRTY_BIT12 );
 	}
+}
 
-	if( fs->disk->read_sector( fs->disk, 0, &fs->bpb ) )
-		return FAT_ERROR;
-	result = validate_bpb( &fs->bpb );
+int mark_volume_clean( FAT_FILESYSTEM* fs, BYTE clean )
+{
+	int		result;
 
-	if( result )
+	switch( fs->FATType )
 	{
-		WARNING( "BPB validation is failed\n" );
-		return FAT_ERROR;
+	case FAT32:
+		update_fat( fs, 1, clean ? get_fat( fs, 1 ) | SHUT_BIT_MASK32 : get_fat( fs, 1 ) & ~SHUT_BIT_MASK32 );
+		result = flush_fat( fs, 1 );
+		break;
+	case FAT16:
+		update_fat( fs, 1, clean ? get_fat( fs, 1 ) | SHUT_BIT_MASK16 : get_fat( fs, 1 ) & ~SHUT_BIT_MASK16 );
+		result = flush_fat( fs, 1 );
+		break;
+	default:
+		if( clean )
+			fs->bpb.bs.reserved1 &= ~VOLUME_DIRTY_BIT12;
+		else
+			fs->bpb.bs.reserved1 |= VOLUME_DIRTY_BIT12;
+		result = fs->disk->write_sector( fs->disk, 0, &fs->bpb );
+		break;
 	}
 
-	fs->FATType = get_fat_type( &fs->bpb );
-	if( fs->FATType > FAT32 )
-		return FAT_ERROR;
+	if( fs->disk->flush && fs->disk->flush( fs->disk ) )
+		result = FAT_ERROR;
 
-	if( read_root_sector( fs, 0, sector ) )
-		return FAT_ERROR;
+	return result;
+}
 
-	ZeroMemory( root, sizeof( FAT_NODE ) );
-	memcpy( &root->entry, sector, sizeof( FAT_DIR_ENTRY ) );
-	root->fs = fs;
+/* The free count and next free cluster of FSInfo are only trusted when the volume was
+ * unmounted cleanly, the clean bit of FAT[1] is set by fat_umount() */
+int read_fsinfo( FAT_FILESYSTEM* fs )
+{
+	if( fs->disk->read_sector( fs->disk, fs->bpb.BPB32.FSInfo, &fs->info32 ) )
+		return FAT_ERROR;
 
-	fs->EOCMark = get_fat( fs, 1 );
-	if( fs->FATType == 2 )
-	{
-		if( fs->EOCMark & SHUT_BIT_MASK32 )
-			WARNING( "disk drive did not dismount correctly\n" );
-		if( fs->EOCMark & ERR_BIT_MASK32 )
-			WARNING( "disk drive has error\n" );
-	}
-	else
+	if( fs->info32.leadSignature != FSINFO_LEAD_SIGNATURE ||
+		fs->info32.structSignature != FSINFO_STRUCT_SIGNATURE ||
+		fs->info32.trailSignature != FSINFO_TRAIL_SIGNATURE )
 	{
-		if( fs->FATType == 1)
-		{
-			if( fs->EOCMark & SHUT_BIT_MASK16 )
-				PRINTF( "disk drive did not dismounted\n" );
-			if( fs->EOCMark & ERR_BIT_MASK16 )
-				PRINTF( "disk drive has error\n" );
-		}
+		ZeroMemory( &fs->info32, sizeof( FAT_FSINFO ) );
+		fs->info32.leadSignature	= FSINFO_LEAD_SIGNATURE;
+		fs->info32.structSignature	= FSINFO_STRUCT_SIGNATURE;
+		fs->info32.trailSignature	= FSINFO_TRAIL_SIGNATURE;
+		return FAT_ERROR;
 	}
 
-	if( fs->bpb.FATSize16 != 0 )
-		fs->FATSize = fs->bpb.FATSize16;
-	else
-		fs->FATSize = fs->bpb.BPB32.FATSize32;
-
-	init_cluster_list( &fs->freeClusterList );
-	search_free_clusters( fs );
+	if( !is_volume_clean( fs ) ||
+		fs->info32.freeCount > fs->freeClusters.clusters - 2 ||
+		fs->info32.nextFree < 2 || fs->info32.nextFree >= fs->freeClusters.clusters )
+		return FAT_ERROR;
 
-	memset( root->entry.name, 0x20, 11 );
 	return FAT_SUCCESS;
 }
 
-/******************************************************************************/
-/* On unmount file system                                                     */
-/******************************************************************************/
-void fat_umount( FAT_FILESYSTEM* fs )
-{
-	release_cluster_list( &fs->freeClusterList );
-}
-
-int read_dir_from_sector( FAT_FILESYSTEM* fs, FAT_ENTRY_LOCATION* location, BYTE* sector, FAT_NODE_ADD adder, void* list )
+int write_fsinfo( FAT_FILESYSTEM* fs )
 {
-	UINT		i, entriesPerSector;
-	FAT_DIR_ENTRY*	dir;
-	FAT_NODE	node;
+	DWORD	freeCount;
+	int		result;
 
-	entriesPerSector = fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY );
-	dir = ( FAT_DIR_ENTRY* )sector;
+	LOCK_FAT( fs );
+	if( fs->freeClusters.hint < 2 || fs->freeClusters.hint >= fs->freeClusters.clusters )
+		fs->info32.nextFree = 2;
+	else
+		fs->info32.nextFree = fs->freeClusters.hint;
 
-	for( i = 0; i < entriesPerSector; i++ )
-	{
-		if( dir->name[0] == DIR_ENTRY_FREE )
-			;
-		else if( dir->name[0] == DIR_ENTRY_NO_MORE )
-			break;
-		else if( !( dir->attribute & ATTR_VOLUME_ID ) )
-		{
-			node.fs = fs;
-			node.location = *location;
-			node.location.number = i;
-			node.entry = *dir;
-			adder( list, &node );		/* call the callback function that adds entries to list */
-		}
+	/* the count is partial while the scan thread has not loaded every chunk */
+	freeCount = fs->info32.freeCount;
+	if( !fs->freeCountKnown )
+		fs->info32.freeCount = FSINFO_UNKNOWN;
 
-		dir++;
-	}
+	result = fs->disk->write_sector( fs->disk, fs->bpb.BPB32.FSInfo, &fs->info32 );
+	fs->info32.freeCount = freeCount;
+	UNLOCK_FAT( fs );
 
-	return ( i == entriesPerSector ? 0 : -1 );
+	return result;
 }
 
-DWORD get_MS_EOC( BYTE FATType )
+/* Load the first FAT in chunks of FAT_LOAD_CHUNK sectors. The groups of 32 entries a chunk
+ * completes are decoded and their free clusters added to the free cluster bitmap while the
+ * data is still hot in the CPU cache. A cleanly unmounted FAT32 volume only loads the chunk
+ * with the reserved entries and the one FSInfo points the allocator at, the rest is loaded
+ * on demand. With FAT_MOUNT_BACKGROUND_SCAN a clean FAT16/32 volume only loads the first
+ * chunk and start_fat_scan() loads the rest after the mount */
+int load_fat( FAT_FILESYSTEM* fs )
 {
-	switch( FATType )
-	{
-	case FAT12:
-		return MS_EOC12;
-	case FAT16:
-		return MS_EOC16;
-	case FAT32:
-		return MS_EOC32;
-	}
+	DWORD	FATBytes = fs->FATSize * fs->bpb.bytesPerSector;
+	DWORD	bitsPerEntry, loaded, count, cluster = 0;
+	UINT32	i;
 
-	WARNING( "Incorrect FATType(%u)\n", FATType );
-	return -1;
-}
+	/* data clusters are numbered from 2 */
+	if( init_cluster_bitmap( &fs->freeClusters, get_count_of_clusters( fs ) + 2 ) )
+		return FAT_ERROR;
 
-int is_EOC( BYTE FATType, SECTOR clusterNumber )
-{
-	switch( FATType )
+	switch( fs->FATType )
 	{
-	case FAT12:
-		if( EOC12 <= ( clusterNumber & 0xFFF ) )
-			return -1;
-
+	case FAT32:
+		bitsPerEntry = 32;
 		break;
 	case FAT16:
-		if( EOC16 <= ( clusterNumber & 0xFFFF ) )
-			return -1;
-
-		break;
-	case FAT32:
-		if( EOC32 <= ( clusterNumber & 0x0FFFFFFF ) )
-			return -1;
+		bitsPerEntry = 16;
 		break;
 	default:
-		WARNING( "Incorrect FATType(%u)\n", FATType );
+		bitsPerEntry = 12;
+		break;
 	}
+	fs->FATEntryCount = FATBytes * 8 / bitsPerEntry;
+
+	/* one spare byte lets a FAT12 entry at the very end be read as a WORD */
+	fs->FATBuffer		= ( BYTE* )calloc( FATBytes + 1, 1 );
+	fs->FATEntries		= ( DWORD* )malloc( fs->FATEntryCount * sizeof( DWORD ) );
+	fs->FATDirtySectors	= ( BYTE* )calloc( ( fs->FATSize + 7 ) / 8, 1 );
+	fs->FATMirrorSectors	= ( BYTE* )calloc( ( fs->FATSize + 7 ) / 8, 1 );
+	fs->FATChunkCount		= ( fs->FATSize + FAT_LOAD_CHUNK - 1 ) / FAT_LOAD_CHUNK;
+	fs->FATChunksLoaded		= ( BYTE* )calloc( fs->FATChunkCount, 1 );
+	if( fs->FATBuffer == NULL || fs->FATEntries == NULL || fs->FATDirtySectors == NULL || fs->FATMirrorSectors == NULL ||
+		fs->FATChunksLoaded == NULL )
+		return FAT_ERROR;
 
-	return 0;
-}
+	if( fs->FATType == FAT32 || ( fs->FATType == FAT16 && ( fs->options.flags & FAT_MOUNT_BACKGROUND_SCAN ) ) )
+	{
+		fs->FATChunksLeft = fs->FATChunkCount;
+		if( load_fat_chunk( fs, 0 ) )
+			return FAT_ERROR;
 
-/******************************************************************************/
+		if( fs->FATType == FAT32 )
+		{
+			if( read_fsinfo( fs ) == FAT_SUCCESS )
+			{
+				fs->freeCountKnown		= 1;
+				fs->freeClusters.hint	= fs->info32.nextFree;
+				if( prepare_fat_entry( fs, fs->info32.nextFree ) )
+					return FAT_ERROR;
+			}
+			else
+				fs->info32.freeCount = fs->freeClusters.count;
+		}
+
+		/* the recovery of a dirty volume needs the whole FAT */
+		if( fs->freeCountKnown || ( ( fs->options.flags & FAT_MOUNT_BACKGROUND_SCAN ) && is_volume_clean( fs ) ) )
+			return FAT_SUCCESS;
+
+		for( i = 1; i < fs->FATChunkCount; i++ )
+		{
+			if( load_fat_chunk( fs, i ) )
+				return FAT_ERROR;
+		}
+
+		return FAT_SUCCESS;
+	}
+
+	for( loaded = 0; loaded < fs->FATSize; loaded += count )
+	{
+		count = MIN( fs->FATSize - loaded, FAT_LOAD_CHUNK );
+		if( fs->disk->read_sectors( fs->disk, fs->bpb.reservedSectorCount + loaded, count,
+				&fs->FATBuffer[loaded * fs->bpb.bytesPerSector] ) )
+			return FAT_ERROR;
+
+		for( ; ( cluster + 32 ) * bitsPerEntry / 8 <= ( loaded + count ) * fs->bpb.bytesPerSector &&
+				cluster + 32 <= fs->FATEntryCount; cluster += 32 )
+			add_free_group( fs, cluster, decode_fat_group( fs, cluster ) );
+	}
+
+	/* the entries of the last incomplete group */
+	for( ; cluster < fs->FATEntryCount; cluster++ )
+		load_fat_entry( fs, cluster );
+
+	memset( fs->FATChunksLoaded, 1, fs->FATChunkCount );
+	fs->info32.freeCount	= fs->freeClusters.count;
+	fs->freeCountKnown		= 1;
+
+	return FAT_SUCCESS;
+}
+
+/* Loads the chunks load_fat() skipped. Each chunk is read into a private buffer outside of
+ * scanLock, so the file system only waits for the decoding of a chunk */
+void* scan_fat( void* param )
+{
+	FAT_FILESYSTEM*	fs = ( FAT_FILESYSTEM* )param;
+	DISK_OPERATIONS*	disk = &fs->lockedDisk.operations;
+	UINT32	chunk, count, chunkBytes = fs->bpb.bytesPerSector * FAT_LOAD_CHUNK;
+	BYTE*	buffer;
+	BYTE	loaded;
+
+	buffer = ( BYTE* )malloc( chunkBytes );
+
+	for( chunk = 1; buffer && chunk < fs->FATChunkCount; chunk++ )
+	{
+		pthread_mutex_lock( &fs->scanLock );
+		loaded = fs->FATChunksLoaded[chunk];
+		pthread_mutex_unlock( &fs->scanLock );
+		if( loaded )
+			continue;
+
+		/* a chunk that can not be read is left to be loaded on demand */
+		count = MIN( fs->FATSize - chunk * FAT_LOAD_CHUNK, FAT_LOAD_CHUNK );
+		if( disk->read_sectors( disk, fs->bpb.reservedSectorCount + chunk * FAT_LOAD_CHUNK, count, buffer ) )
+			continue;
+
+		pthread_mutex_lock( &fs->scanLock );
+		if( !fs->FATChunksLoaded[chunk] )
+		{
+			memcpy( &fs->FATBuffer[chunk * chunkBytes], buffer, count * fs->bpb.bytesPerSector );
+			decode_fat_chunk( fs, chunk );
+		}
+		pthread_mutex_unlock( &fs->scanLock );
+	}
+
+	free( buffer );
+
+	pthread_mutex_lock( &fs->scanLock );
+	fs->scanDone = 1;
+	pthread_mutex_unlock( &fs->scanLock );
+
+	return NULL;
+}
+
+/* Start a thread loading the chunks of the FAT that are not loaded yet. The io_uring and
+ * O_DIRECT disks can not be used by two threads at once, so until finish_fat_scan() the disk
+ * is shared through a locked synchronous wrapper. Loads the chunks here when no thread can be
+ * started */
+int start_fat_scan( FAT_FILESYSTEM* fs )
+{
+	pthread_mutexattr_t	attr;
+	UINT32	i;
+
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+
+	if( pthread_mutex_init( &fs->scanLock, &attr ) == 0 )
+	{
+		if( disk_init_locked( &fs->lockedDisk, fs->disk ) == 0 )
+		{
+			fs->scanDisk	= fs->disk;
+			fs->disk		= &fs->lockedDisk.operations;
+			fs->cache.disk	= fs->disk;
+			fs->scanDone	= 0;
+			fs->scanning	= 1;
+
+			if( pthread_create( &fs->scanThread, NULL, scan_fat, fs ) == 0 )
+			{
+				pthread_mutexattr_destroy( &attr );
+				return FAT_SUCCESS;
+			}
+
+			fs->scanning	= 0;
+			fs->disk		= fs->scanDisk;
+			fs->cache.disk	= fs->disk;
+			disk_uninit_locked( &fs->lockedDisk );
+		}
+		pthread_mutex_destroy( &fs->scanLock );
+	}
+	pthread_mutexattr_destroy( &attr );
+
+	for( i = 1; i < fs->FATChunkCount; i++ )
+	{
+		if( load_fat_chunk( fs, i ) )
+			return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* Join the scan thread when it is done, or after waiting for it when wait is set, and give
+ * the disk back to the file system alone */
+void finish_fat_scan( FAT_FILESYSTEM* fs, BYTE wait )
+{
+	BYTE	done;
+
+	if( !fs->scanning )
+		return;
+
+	pthread_mutex_lock( &fs->scanLock );
+	done = fs->scanDone;
+	pthread_mutex_unlock( &fs->scanLock );
+
+	if( !done && !wait )
+		return;
+
+	pthread_join( fs->scanThread, NULL );
+
+	fs->scanning	= 0;
+	fs->disk		= fs->scanDisk;
+	fs->cache.disk	= fs->disk;
+	disk_uninit_locked( &fs->lockedDisk );
+	pthread_mutex_destroy( &fs->scanLock );
+}
+
+/* the free count is exact only once the scan thread loaded the whole FAT */
+void wait_free_count( FAT_FILESYSTEM* fs )
+{
+	BYTE	known;
+
+	LOCK_FAT( fs );
+	known = fs->freeCountKnown;
+	UNLOCK_FAT( fs );
+
+	finish_fat_scan( fs, !known );
+}
+
+void release_fat( FAT_FILESYSTEM* fs )
+{
+	free( fs->FATBuffer );
+	free( fs->FATEntries );
+	free( fs->FATDirtySectors );
+	free( fs->FATMirrorSectors );
+	free( fs->FATChunksLoaded );
+
+	fs->FATChunksLoaded	= NULL;
+	fs->FATBuffer		= NULL;
+	fs->FATEntries		= NULL;
+	fs->FATDirtySectors	= NULL;
+	fs->FATMirrorSectors	= NULL;
+}
+
+#define IS_FAT_SECTOR_SET( bitmap, sector )	( ( bitmap )[( sector ) / 8] & ( 1 << ( ( sector ) % 8 ) ) )
+
+/* Write the sectors marked in the bitmap to one copy of the FAT, adjacent ones by a single request */
+int write_fat_copy( FAT_FILESYSTEM* fs, const BYTE* bitmap, UINT32 copy )
+{
+	SECTOR	base = fs->bpb.reservedSectorCount + copy * fs->FATSize;
+	DWORD	first, last;
+	int		result = FAT_SUCCESS;
+
+	for( first = 0; first < fs->FATSize; first = last + 1 )
+	{
+		if( !IS_FAT_SECTOR_SET( bitmap, first ) )
+		{
+			last = first;
+			continue;
+		}
+
+		for( last = first; last < fs->FATSize && IS_FAT_SECTOR_SET( bitmap, last ); last++ )
+			;
+
+		if( fs->disk->write_sectors( fs->disk, base + first, last - first, &fs->FATBuffer[first * fs->bpb.bytesPerSector] ) )
+			result = FAT_ERROR;
+	}
+
+	return result;
+}
+
+/* Write the dirty sectors of the in-memory FAT to the first copy. The other copies are
+ * written copy by copy in one sequential pass, on every flush when mirroring eagerly and
+ * otherwise only when mirror is set, so set_fat() does not pay for them */
+int flush_fat( FAT_FILESYSTEM* fs, BYTE mirror )
+{
+	DWORD	i, bitmapSize = ( fs->FATSize + 7 ) / 8;
+	int		result = FAT_SUCCESS;
+
+	if( write_fat_copy( fs, fs->FATDirtySectors, 0 ) )
+		return FAT_ERROR;
+
+	for( i = 0; i < bitmapSize; i++ )
+	{
+		fs->FATMirrorSectors[i] |= fs->FATDirtySectors[i];
+		fs->FATDirtySectors[i] = 0;
+	}
+
+	if( !mirror && !( fs->options.flags & FAT_MOUNT_EAGER_MIRROR ) )
+		return FAT_SUCCESS;
+
+	for( i = 1; i < fs->bpb.numberOfFATs; i++ )
+	{
+		if( write_fat_copy( fs, fs->FATMirrorSectors, i ) )
+			result = FAT_ERROR;
+	}
+
+	if( result == FAT_SUCCESS )
+		ZeroMemory( fs->FATMirrorSectors, bitmapSize );
+
+	return result;
+}
+
+/* Read a FAT entry from FAT Table. While the scan thread runs FATChunksLeft is only read
+ * under its lock */
+DWORD get_fat( FAT_FILESYSTEM* fs, SECTOR cluster )
+{
+	if( cluster >= fs->FATEntryCount || ( ( fs->scanning || fs->FATChunksLeft ) && prepare_fat_entry( fs, cluster ) ) )
+		return FAT_ERROR;
+
+	return fs->FATEntries[cluster];
+}
+
+/* Change a FAT entry in memory only, the caller flushes the FAT */
+int update_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value )
+{
+	DWORD	first, last;
+
+	if( cluster >= fs->FATEntryCount || ( ( fs->scanning || fs->FATChunksLeft ) && prepare_fat_entry( fs, cluster ) ) )
+		return FAT_ERROR;
+
+	fs->type->encode_entry( fs->FATBuffer, cluster, value );
+	fs->FATEntries[cluster] = fs->type->decode_entry( fs->FATBuffer, cluster );
+
+	/* the sectors of the first and the last byte of the entry, a FAT12 one may straddle two */
+	first	= cluster * fs->type->nibblesPerEntry / 2 / fs->bpb.bytesPerSector;
+	last	= ( cluster * fs->type->nibblesPerEntry + fs->type->nibblesPerEntry - 1 ) / 2 / fs->bpb.bytesPerSector;
+	fs->FATDirtySectors[first / 8] |= 1 << ( first % 8 );
+	fs->FATDirtySectors[last / 8] |= 1 << ( last % 8 );
+
+	return FAT_SUCCESS;
+}
+
+/* Write a FAT entry to FAT Table */
+int set_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value )
+{
+	if( update_fat( fs, cluster, value ) )
+		return FAT_ERROR;
+
+	/* without write-back the change reaches the disk right away */
+	if( !fs->cache.writeBack )
+		return flush_fat( fs, 0 );
+
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Format disk as a specified file system                                     */
+/******************************************************************************/
+int fat_format( DISK_OPERATIONS* disk, BYTE FATType )
+{
+	FAT_BPB bpb;
+
+	if( fill_bpb( &bpb, FATType, disk->numberOfSectors, disk->bytesPerSector ) != FAT_SUCCESS ) // bpb ʱȭ
+		return FAT_ERROR;
+
+	disk->write_sector( disk, 0, &bpb );
+
+	PRINTF( "bytes per sector       : %u\n", bpb.bytesPerSector );
+	PRINTF( "sectors per cluster    : %u\n", bpb.sectorsPerCluster );
+	PRINTF( "number of FATs         : %u\n", bpb.numberOfFATs );
+	PRINTF( "root entry count       : %u\n", bpb.rootEntryCount );
+	PRINTF( "total sectors          : %u\n", ( bpb.totalSectors ? bpb.totalSectors : bpb.totalSectors32 ) );
+	PRINTF( "\n" );
+
+	clear_fat( disk, &bpb ); // FAT ̺ ʱȭ
+	if( get_fat_type( &bpb ) == FAT32 )
+		create_fsinfo( disk, &bpb );
+	create_root( disk, &bpb ); // root 丮  + ʱȭ
+
+	return FAT_SUCCESS;
+}
+
+int validate_bpb( FAT_BPB* bpb )
+{
+	int FATType;
+
+	if( !( bpb->jmpBoot[0] == 0xEB && bpb->jmpBoot[2] == 0x90 ) &&
+		!( bpb->jmpBoot[0] == 0xE9 ) )
+		return FAT_ERROR;
+
+	FATType = get_fat_type( bpb );
+
+	if( FATType < 0 )
+		return FAT_ERROR;
+
+	return FAT_SUCCESS;
+}
+
+/* when FAT type is FAT12 or FAT16 */
+int read_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, BYTE* sector )
+{
+	SECTOR	rootSector;
+
+	rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 );
+
+	return cache_read_sector( &fs->cache, rootSector + sectorNumber, sector );
+}
+
+int write_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, const BYTE* sector )
+{
+	SECTOR	rootSector;
+
+	rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 );
+
+	return cache_write_sector( &fs->cache, rootSector + sectorNumber, sector, SECTOR_META );
+}
+
+SECTOR get_root_dir_sectors( FAT_FILESYSTEM* fs )
+{
+	return ( ( fs->bpb.rootEntryCount * 32 ) + ( fs->bpb.bytesPerSector - 1 ) ) / fs->bpb.bytesPerSector;
+}
+
+/* Translate logical cluster and sector numbers to a physical sector number */
+SECTOR	calc_physical_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber )
+{
+	SECTOR	firstDataSector;
+	SECTOR	firstSectorOfCluster;
+	SECTOR	rootDirSectors;
+
+	rootDirSectors = ( ( fs->bpb.rootEntryCount * 32 ) + ( fs->bpb.bytesPerSector - 1 ) ) / fs->bpb.bytesPerSector ;
+	firstDataSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->FATSize ) + rootDirSectors;
+	firstSectorOfCluster = ( ( clusterNumber - 2 ) * fs->bpb.sectorsPerCluster ) + firstDataSector;
+
+	return firstSectorOfCluster + sectorNumber;
+}
+
+int read_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, BYTE* sector )
+{
+	return cache_read_sector( &fs->cache, calc_physical_sector( fs, clusterNumber, sectorNumber ), sector );
+}
+
+int write_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, const BYTE* sector )
+{
+	return cache_write_sector( &fs->cache, calc_physical_sector( fs, clusterNumber, sectorNumber ), sector, SECTOR_META );
+}
+
+/* Splits the part of [offset, end) that lies in the run of clusters contiguous on the disk from
+ * the cluster of offset into a partial head sector, whole sectors and a partial tail sector, so
+ * the run is transferred by one vectored request. Whole sectors use the caller's buffer directly,
+ * partial ones use the head and tail buffers. Only the first run of a transfer can have a head
+ * and only the last one a tail */
+void prepare_cluster_transfer( FAT_FILESYSTEM* fs, DWORD offset, DWORD end, UINT32 clusters, BYTE* buffer, BYTE* head, BYTE* tail, CLUSTER_TRANSFER* transfer )
+{
+	DWORD	bytesPerSector = fs->bpb.bytesPerSector;
+	DWORD	clusterSize = bytesPerSector * fs->bpb.sectorsPerCluster;
+	DWORD	sectorOffset = offset % bytesPerSector;
+	DWORD	position = offset;
+	DWORD	wholeSectors;
+
+	end = MIN( end, ( offset / clusterSize + clusters ) * clusterSize );
+
+	transfer->sectorNumber	= ( offset % clusterSize ) / bytesPerSector;
+	transfer->sectorCount	= 0;
+	transfer->iovCount		= 0;
+	transfer->headOffset	= sectorOffset;
+	transfer->headLength	= 0;
+	transfer->tailLength	= 0;
+	transfer->length		= end - offset;
+
+	if( sectorOffset != 0 )
+	{
+		transfer->headLength = MIN( bytesPerSector - sectorOffset, end - position );
+		transfer->iov[transfer->iovCount].buffer	= head;
+		transfer->iov[transfer->iovCount++].count	= 1;
+		transfer->sectorCount++;
+		position += transfer->headLength;
+	}
+
+	wholeSectors = ( end - position ) / bytesPerSector;
+	if( wholeSectors )
+	{
+		transfer->iov[transfer->iovCount].buffer	= buffer + ( position - offset );
+		transfer->iov[transfer->iovCount++].count	= wholeSectors;
+		transfer->sectorCount += wholeSectors;
+		position += wholeSectors * bytesPerSector;
+	}
+
+	if( position < end )
+	{
+		transfer->tailLength = end - position;
+		transfer->iov[transfer->iovCount].buffer	= tail;
+		transfer->iov[transfer->iovCount++].count	= 1;
+		transfer->sectorCount++;
+	}
+}
+
+void set_cluster_request( FAT_FILESYSTEM* fs, SECTOR clusterNumber, const CLUSTER_TRANSFER* transfer, BYTE write, DISK_REQUEST* request )
+{
+	request->write		= write;
+	request->sector		= calc_physical_sector( fs, clusterNumber, transfer->sectorNumber );
+	request->iov		= transfer->iov;
+	request->iovCount	= transfer->iovCount;
+}
+
+int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root )
+{
+	INT		result;
+	BYTE	sector[MAX_SECTOR_SIZE];
+
+	if( fs == NULL || fs->disk == NULL )
+	{
+		WARNING( "DISK_OPERATIONS : %p\nFAT_FILESYSTEM : %p\n", fs, fs->disk );
+		return FAT_ERROR;
+	}
+
+	if( fs->disk->read_sector( fs->disk, 0, &fs->bpb ) )
+		return FAT_ERROR;
+	result = validate_bpb( &fs->bpb );
+
+	if( result )
+	{
+		WARNING( "BPB validation is failed\n" );
+		return FAT_ERROR;
+	}
+
+	fs->FATType = get_fat_type( &fs->bpb );
+	if( fs->FATType > FAT32 )
+		return FAT_ERROR;
+	fs->type = &g_FATTypes[fs->FATType];
+
+	if( init_sector_cache( &fs->cache, fs->disk, ( fs->options.flags & FAT_MOUNT_NO_CACHE ? 0 :
+			( fs->options.cacheSectors ? fs->options.cacheSectors : SECTOR_CACHE_DEFAULT_SIZE ) ) ) )
+		return FAT_ERROR;
+
+	if( ( fs->options.flags & FAT_MOUNT_WRITE_BACK ) &&
+		cache_set_write_back( &fs->cache, fs->options.dirtySectors, fs->options.dirtyExpire ) )
+	{
+		release_sector_cache( &fs->cache );
+		return FAT_ERROR;
+	}
+
+	/* delayed data is held back like the dirty sectors of the write-back cache */
+	if( !fs->cache.writeBack )
+		fs->options.flags &= ~FAT_MOUNT_DELAYED_ALLOC;
+	fs->delayed			= NULL;
+	fs->delayedBytes	= 0;
+	fs->delayedClusters	= 0;
+
+	ZeroMemory( fs->slots, sizeof( fs->slots ) );
+	fs->slotsClock = 0;
+
+	if( read_root_sector( fs, 0, sector ) )
+	{
+		release_sector_cache( &fs->cache );
+		return FAT_ERROR;
+	}
+
+	init_extent_cache( &fs->extents );
+	if( init_dentry_cache( &fs->dentries, fs->options.dentryCount ? fs->options.dentryCount : DENTRY_CACHE_DEFAULT_SIZE ) )
+	{
+		release_sector_cache( &fs->cache );
+		return FAT_ERROR;
+	}
+	init_dir_filters( &fs->filters );
+
+	ZeroMemory( root, sizeof( FAT_NODE ) );
+	memcpy( &root->entry, sector, sizeof( FAT_DIR_ENTRY ) );
+	root->fs = fs;
+
+	if( fs->bpb.FATSize16 != 0 )
+		fs->FATSize = fs->bpb.FATSize16;
+	else
+		fs->FATSize = fs->bpb.BPB32.FATSize32;
+
+	if( load_fat( fs ) )
+	{
+		release_fat( fs );
+		release_cluster_bitmap( &fs->freeClusters );
+		release_sector_cache( &fs->cache );
+		release_dentry_cache( &fs->dentries );
+		release_dir_filters( &fs->filters );
+		return FAT_ERROR;
+	}
+
+	/* the bits are set while the volume is clean */
+	fs->EOCMark = get_fat( fs, 1 );
+	if( ( fs->FATType == FAT32 && !( fs->EOCMark & ERR_BIT_MASK32 ) ) ||
+		( fs->FATType == FAT16 && !( fs->EOCMark & ERR_BIT_MASK16 ) ) )
+		WARNING( "disk drive has error\n" );
+
+	/* a clean volume skips the recovery scan, a FAT32 one also trusted FSInfo in load_fat() */
+	fs->unrecovered = 0;
+	if( !is_volume_clean( fs ) )
+	{
+		WARNING( "disk drive did not dismount correctly\n" );
+		fs->unrecovered = ( recover_volume( fs ) != FAT_SUCCESS );
+	}
+
+	/* in use until fat_umount() marks it clean again */
+	mark_volume_clean( fs, 0 );
+
+	if( ( fs->options.flags & FAT_MOUNT_BACKGROUND_SCAN ) && fs->FATChunksLeft && start_fat_scan( fs ) )
+		WARNING( "FAT can not be loaded\n" );
+
+	memset( root->entry.name, 0x20, 11 );
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* On unmount file system                                                     */
+/******************************************************************************/
+/* writes the dirty cached sectors and asks the disk to make them durable */
+int fat_sync( FAT_FILESYSTEM* fs )
+{
+	int	result;
+
+	finish_fat_scan( fs, 0 );
+
+	result = flush_delayed_writes( fs );
+	if( cache_flush( &fs->cache ) )
+		result = FAT_ERROR;
+	if( flush_fat( fs, 1 ) )
+		result = FAT_ERROR;
+	if( fs->FATType == FAT32 && write_fsinfo( fs ) )
+		result = FAT_ERROR;
+	if( fs->disk->flush && fs->disk->flush( fs->disk ) )
+		result = FAT_ERROR;
+
+	return result;
+}
+
+void fat_umount( FAT_FILESYSTEM* fs )
+{
+	finish_fat_scan( fs, 1 );
+
+	/* the clean bit is set only after everything else is on the disk */
+	if( fat_sync( fs ) == FAT_SUCCESS && !fs->unrecovered )
+		mark_volume_clean( fs, 1 );
+	release_delayed_writes( fs );
+
+	release_cluster_bitmap( &fs->freeClusters );
+	release_sector_cache( &fs->cache );
+	release_extent_cache( &fs->extents );
+	release_dentry_cache( &fs->dentries );
+	release_dir_filters( &fs->filters );
+	release_fat( fs );
+}
+
+/* FATType was validated by fat_read_superblock() or fat_format() */
+DWORD get_MS_EOC( BYTE FATType )
+{
+	return g_FATTypes[FATType].MSEOC;
+}
+
+int is_EOC( BYTE FATType, SECTOR clusterNumber )
+{
+	return -( ( clusterNumber & g_FATTypes[FATType].mask ) >= g_FATTypes[FATType].EOC );
+}
+
+/******************************************************************************/
+/* Walk the entries of a directory one at a time                              */
+/******************************************************************************/
+int fat_opendir( const FAT_NODE* dir, FAT_DIR* cursor )
+{
+	cursor->fs = dir->fs;
+
+	if( IS_POINT_ROOT_ENTRY( dir->entry ) && ( dir->fs->FATType == FAT12 || dir->fs->FATType == FAT16 ) )
+		cursor->location.cluster = 0;
+	else
+		cursor->location.cluster = GET_FIRST_CLUSTER( dir->entry );
+	cursor->location.sector = 0;
+	cursor->location.number = 0;
+
+	cursor->loaded	= 0;
+	cursor->end		= 0;
+
+	return FAT_SUCCESS;
+}
+
+/* continues a walk from a location it had, the sector is read again */
+int fat_seekdir( FAT_DIR* cursor, const FAT_ENTRY_LOCATION* location )
+{
+	cursor->location	= *location;
+	cursor->loaded		= 0;
+	cursor->end			= 0;
+
+	return FAT_SUCCESS;
+}
+
+/* The next entry of the directory, deleted entries and volume labels are skipped.
+ * Returns FAT_END_OF_DIR after the last entry */
+int fat_readdir( FAT_DIR* cursor, FAT_NODE* entry )
+{
+	const FAT_DIR_ENTRY*	dir = ( const FAT_DIR_ENTRY* )cursor->sector;
+	const FAT_DIR_ENTRY*	current;
+	INT32	entriesPerSector = cursor->fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY );
+
+	while( !cursor->end )
+	{
+		if( cursor->location.number >= entriesPerSector )
+		{
+			if( next_dir_sector( cursor->fs, &cursor->location ) )
+			{
+				cursor->end = 1;
+				break;
+			}
+			cursor->loaded = 0;
+		}
+
+		if( !cursor->loaded )
+		{
+			if( read_dir_sector( cursor->fs, &cursor->location, cursor->sector ) )
+				return FAT_ERROR;
+			cursor->loaded = 1;
+		}
+
+		current = &dir[cursor->location.number];
+		if( current->name[0] == DIR_ENTRY_NO_MORE )
+		{
+			cursor->end = 1;
+			break;
+		}
+
+		cursor->location.number++;
+		if( current->name[0] == DIR_ENTRY_FREE || ( current->attribute & ATTR_VOLUME_ID ) )
+			continue;
+
+		entry->fs = cursor->fs;
+		entry->entry = *current;
+		entry->location = cursor->location;
+		entry->location.number--;
+		apply_delayed_size( cursor->fs, entry );
+
+		return FAT_SUCCESS;
+	}
+
+	return FAT_END_OF_DIR;
+}
+
+void fat_closedir( FAT_DIR* cursor )
+{
+	cursor->loaded	= 0;
+	cursor->end		= 1;
+}
+
+/******************************************************************************/
 /* Read all entries in the current directory                                  */
 /******************************************************************************/
 int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list )
 {
-	BYTE	sector[MAX_SECTOR_SIZE];
-	SECTOR	i, j, rootEntryCount;
-	FAT_ENTRY_LOCATION location;
+	FAT_DIR		cursor;
+	FAT_NODE	node;
+	int			result;
 
-	if( IS_POINT_ROOT_ENTRY( dir->entry ) && ( dir->fs->FATType == FAT12 || dir->fs->FATType == FAT16 ) )
-	{
-		if( dir->fs->FATType != FAT32 )
-			rootEntryCount = dir->fs->bpb.rootEntryCount;
+	fat_opendir( dir, &cursor );
 
-		for( i = 0; i < rootEntryCount; i++ )
+	/* call the callback function that adds entries to list, a failure ends the walk */
+	while( ( result = fat_readdir( &cursor, &node ) ) == FAT_SUCCESS )
+	{
+		if( adder( list, &node ) )
 		{
-			read_root_sector( dir->fs, i, sector );
-			location.cluster = 0;
-			location.sector = i;
-			location.number = 0;
-			if( read_dir_from_sector( dir->fs, &location, sector, adder, list ) )
-				break;
+			result = FAT_ERROR;
+			break;
 		}
 	}
+
+	fat_closedir( &cursor );
+
+	return ( result == FAT_END_OF_DIR ? FAT_SUCCESS : FAT_ERROR );
+}
+
+/* marks a chain reachable, returns 0 when its first cluster was already marked */
+int mark_reachable_chain( FAT_RECOVERY* recovery, SECTOR cluster )
+{
+	FAT_FILESYSTEM*	fs = recovery->fs;
+	SECTOR			first = cluster;
+
+	while( cluster >= 2 && cluster < fs->freeClusters.clusters &&
+		!( recovery->reachable[cluster / 8] & ( 1 << ( cluster % 8 ) ) ) )
+	{
+		recovery->reachable[cluster / 8] |= 1 << ( cluster % 8 );
+		cluster = get_fat( fs, cluster );
+	}
+
+	return cluster != first;
+}
+
+int add_reachable_entry( void* list, FAT_NODE* node )
+{
+	FAT_RECOVERY*	recovery = ( FAT_RECOVERY* )list;
+	SECTOR			cluster = GET_FIRST_CLUSTER( node->entry );
+	SECTOR*			directories;
+
+	/* "." and ".." point back to directories that are already walked */
+	if( node->entry.name[0] == '.' )
+		return 0;
+
+	if( !mark_reachable_chain( recovery, cluster ) || !( node->entry.attribute & ATTR_DIRECTORY ) )
+		return 0;
+
+	if( recovery->count == recovery->size )
+	{
+		directories = ( SECTOR* )realloc( recovery->directories, ( recovery->size * 2 + 16 ) * sizeof( SECTOR ) );
+		if( directories == NULL )
+			return FAT_ERROR;
+
+		recovery->directories	= directories;
+		recovery->size			= recovery->size * 2 + 16;
+	}
+	recovery->directories[recovery->count++] = cluster;
+
+	return 0;
+}
+
+/* After an unclean unmount the FAT may hold chains no directory entry points to, as clusters
+ * are linked before the entry is written, and the FAT copies may differ because they are
+ * mirrored lazily. Walks the directory tree, frees every allocated cluster it did not reach
+ * and rewrites all FAT copies from the first one. When a directory can not be walked nothing
+ * is freed, the clusters not reached may still belong to files, and the volume stays dirty */
+int recover_volume( FAT_FILESYSTEM* fs )
+{
+	FAT_RECOVERY	recovery;
+	FAT_NODE		dir;
+	SECTOR			cluster;
+	DWORD			value, badCluster = get_MS_EOC( fs->FATType ) - 8;
+	UINT32			lost = 0;
+	int				result = FAT_SUCCESS;
+
+	ZeroMemory( &recovery, sizeof( FAT_RECOVERY ) );
+	recovery.fs			= fs;
+	recovery.reachable	= ( BYTE* )calloc( ( fs->freeClusters.clusters + 7 ) / 8, 1 );
+	if( recovery.reachable == NULL )
+		return FAT_ERROR;
+
+	ZeroMemory( &dir, sizeof( FAT_NODE ) );
+	dir.fs = fs;
+	dir.entry.attribute = ATTR_DIRECTORY;
+
+	if( fs->FATType == FAT32 )
+	{
+		SET_FIRST_CLUSTER( dir.entry, fs->bpb.BPB32.rootCluster );
+		mark_reachable_chain( &recovery, fs->bpb.BPB32.rootCluster );
+	}
 	else
+		memset( dir.entry.name, 0x20, 11 );
+
+	while( 1 )
 	{
-		i = GET_FIRST_CLUSTER( dir->entry );
-		do
+		if( fat_read_dir( &dir, add_reachable_entry, &recovery ) )
 		{
-			for( j = 0; j < dir->fs->bpb.sectorsPerCluster; j++ )
-			{
-				read_data_sector( dir->fs, i, j, sector );
-				location.cluster = i;
-				location.sector = j;
-				location.number = 0;
+			result = FAT_ERROR;
+			break;
+		}
 
-				if( read_dir_from_sector( dir->fs, &location, sector, adder, list ) )
-					break;
-			}
-			i = get_fat( dir->fs, i );
-		} while( !is_EOC( dir->fs->FATType, i ) && i != 0 );
+		if( recovery.count == 0 )
+			break;
+
+		cluster = recovery.directories[--recovery.count];
+		SET_FIRST_CLUSTER( dir.entry, cluster );
+		dir.entry.name[0] = 0;
 	}
 
-	return FAT_SUCCESS;
+	for( cluster = 2; result == FAT_SUCCESS && cluster < fs->freeClusters.clusters; cluster++ )
+	{
+		value = get_fat( fs, cluster );
+		if( value == FREE_CLUSTER || value == badCluster || ( recovery.reachable[cluster / 8] & ( 1 << ( cluster % 8 ) ) ) )
+			continue;
+
+		update_fat( fs, cluster, FREE_CLUSTER );
+		add_free_clusters( fs, cluster, 1 );
+		lost++;
+	}
+
+	memset( fs->FATMirrorSectors, 0xFF, ( fs->FATSize + 7 ) / 8 );
+	if( result == FAT_SUCCESS )
+		PRINTF( "%u lost clusters are freed\n", lost );
+	else
+		WARNING( "directories can not be walked, lost clusters are not freed\n" );
+
+	free( recovery.reachable );
+	free( recovery.directories );
+
+	if( flush_fat( fs, 1 ) )
+		result = FAT_ERROR;
+
+	return result;
+}
+
+/* hands a run of freed clusters back to the allocator */
+int add_free_clusters( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count )
+{
+	UINT32	freed;
+
+	LOCK_FAT( fs );
+	freed = set_clusters_free( &fs->freeClusters, first, count );
+	fs->info32.freeCount += freed;
+	UNLOCK_FAT( fs );
+
+	return freed == count ? FAT_SUCCESS : FAT_ERROR;
 }
 
-int add_free_cluster( FAT_FILESYSTEM* fs, SECTOR cluster )
+/* the free clusters not reserved for delayed data, see add_delayed_write() */
+UINT32 get_available_clusters( FAT_FILESYSTEM* fs )
 {
-	return push_cluster( &fs->freeClusterList, cluster );
+	if( fs->info32.freeCount <= fs->delayedClusters )
+		return 0;
+
+	return fs->info32.freeCount - fs->delayedClusters;
 }
 
+/* hands out clusters in ascending order after the last one allocated */
 SECTOR alloc_free_cluster( FAT_FILESYSTEM* fs )
 {
 	SECTOR	cluster;
+	int		result;
 
-	if( pop_cluster( &fs->freeClusterList, &cluster ) == FAT_ERROR )
+	/* the free count is only partial while the FAT is loaded lazily, but there is no delayed
+	 * data before it is complete */
+	if( fs->delayedClusters && get_available_clusters( fs ) == 0 )
 		return 0;
 
+	LOCK_FAT( fs );
+	while( ( result = find_free_cluster( &fs->freeClusters, fs->freeClusters.hint, &cluster ) ) == FAT_ERROR &&
+		load_next_fat_chunk( fs ) == FAT_SUCCESS )
+		;
+
+	if( result == FAT_SUCCESS )
+	{
+		set_cluster_used( &fs->freeClusters, cluster );
+		fs->freeClusters.hint = cluster + 1;
+		fs->info32.freeCount--;
+	}
+	else
+		cluster = 0;
+	UNLOCK_FAT( fs );
+
 	return cluster;
 }
 
+/* Allocate up to count clusters in as few contiguous runs as the free space allows and link
+ * them after lastCluster, or as a new chain when it is 0, with a single FAT flush.
+ * Returns the first allocated cluster, 0 when no cluster is free */
+SECTOR alloc_cluster_chain( FAT_FILESYSTEM* fs, SECTOR lastCluster, UINT32 count )
+{
+	SECTOR	firstCluster = 0, run, i;
+	UINT32	length;
+
+	/* the clusters reserved for delayed data are left to it */
+	if( fs->delayedClusters )
+		count = MIN( count, get_available_clusters( fs ) );
+
+	LOCK_FAT( fs );
+	while( count )
+	{
+		/* a longer run may be in a part of the FAT that is not loaded yet */
+		length = find_free_run( &fs->freeClusters, fs->freeClusters.hint, count, &run );
+		if( length < count && load_next_fat_chunk( fs ) == FAT_SUCCESS )
+			continue;
+		if( length == 0 )
+			break;
+
+		set_clusters_used( &fs->freeClusters, run, length );
+		fs->freeClusters.hint = run + length;
+		fs->info32.freeCount -= length;
+
+		if( lastCluster )
+			update_fat( fs, lastCluster, run );
+		for( i = run; i < run + length - 1; i++ )
+			update_fat( fs, i, i + 1 );
+
+		if( firstCluster == 0 )
+			firstCluster = run;
+		lastCluster = run + length - 1;
+		count -= length;
+	}
+	UNLOCK_FAT( fs );
+
+	if( firstCluster == 0 )
+		return 0;
+
+	update_fat( fs, lastCluster, get_MS_EOC( fs->FATType ) );
+	if( !fs->cache.writeBack )
+		flush_fat( fs, 0 );
+
+	return firstCluster;
+}
+
 SECTOR span_cluster_chain( FAT_FILESYSTEM* fs, SECTOR clusterNumber )
 {
-	UINT32	nextCluster;
+	return alloc_cluster_chain( fs, clusterNumber, 1 );
+}
+
+/* Map the chain starting at firstCluster through a logical cluster index. Only the part of the
+ * chain past its cached extent map is walked through the FAT. Fails when the chain ends before
+ * the index, the map then covers the whole chain */
+int map_file_chain( FAT_FILESYSTEM* fs, SECTOR firstCluster, UINT32 logical, EXTENT_MAP** ret )
+{
+	EXTENT_MAP*	map;
+	SECTOR		next;
+
+	map = *ret = get_extent_map( &fs->extents, firstCluster );
+
+	/* an empty file has no chain, its map is handed out empty and not kept */
+	if( firstCluster < 2 )
+	{
+		invalidate_extent_map( &fs->extents, firstCluster );
+		return FAT_ERROR;
+	}
 
-	nextCluster = alloc_free_cluster( fs );
+	if( map->clusters == 0 && add_extent_cluster( map, firstCluster ) )
+		return FAT_ERROR;
 
-	if( nextCluster )
+	while( map->clusters <= logical )
 	{
-		set_fat( fs, clusterNumber, nextCluster );
-		set_fat( fs, nextCluster, get_MS_EOC( fs->FATType ) );
+		/* the end of chain, free and bad marks are all out of the cluster range */
+		next = get_fat( fs, get_last_extent_cluster( map ) );
+		if( next < 2 || next >= fs->freeClusters.clusters || add_extent_cluster( map, next ) )
+			return FAT_ERROR;
 	}
 
-	return nextCluster;
+	return FAT_SUCCESS;
+}
+
+/* Find the physical cluster at a logical index of a chain and how many clusters from it up to
+ * lastLogical are contiguous on the disk, a contiguous file is a single run */
+int get_file_run( FAT_FILESYSTEM* fs, SECTOR firstCluster, UINT32 logical, UINT32 lastLogical, SECTOR* cluster, UINT32* length )
+{
+	EXTENT_MAP*	map;
+
+	/* a chain shorter than lastLogical still has a run when it reaches logical */
+	map_file_chain( fs, firstCluster, lastLogical, &map );
+
+	*length = find_extent_run( map, logical, cluster );
+	if( *length == 0 )
+		return FAT_ERROR;
+
+	*length = MIN( *length, lastLogical - logical + 1 );
+	return FAT_SUCCESS;
 }
 
 int find_entry_at_sector( const BYTE* sector, const BYTE* formattedName, UINT32 begin, UINT32 last, UINT32* number )
@@ -791,6 +1778,36 @@ int find_entry_at_sector( const BYTE* sector, const BYTE* formattedName, UINT32
 	return -1;
 }
 
+/* true for a name looked up by a caller, not a free slot or the end of a directory */
+#define IS_ENTRY_NAME( name )	( ( name ) != NULL && ( name )[0] != DIR_ENTRY_FREE && ( name )[0] != DIR_ENTRY_NO_MORE )
+
+/* A lookup caches every entry of the sectors it reads, later lookups in the directory hit.
+ * The names also go to the filter being built when the scan started at the directory's front */
+void cache_dir_sector( FAT_FILESYSTEM* fs, SECTOR parent, SECTOR cluster, UINT32 sectorNumber, const BYTE* sector )
+{
+	const FAT_DIR_ENTRY*	entry = ( const FAT_DIR_ENTRY* )sector;
+	UINT32	i;
+
+	for( i = 0; i < fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY ); i++ )
+	{
+		if( entry[i].name[0] == DIR_ENTRY_NO_MORE )
+			break;
+		if( entry[i].name[0] == DIR_ENTRY_FREE )
+			continue;
+
+		collect_dir_filter_name( &fs->filters, entry[i].name );
+		if( !( entry[i].attribute & ATTR_VOLUME_ID ) )
+			add_dentry( &fs->dentries, parent, cluster, sectorNumber, i, &entry[i] );
+	}
+}
+
+/* an entry inserted into a directory is known to its dentry cache and name filter */
+void cache_inserted_entry( FAT_FILESYSTEM* fs, SECTOR parent, const FAT_NODE* node )
+{
+	add_dentry( &fs->dentries, parent, node->location.cluster, node->location.sector, node->location.number, &node->entry );
+	add_dir_filter_name( &fs->filters, parent, node->entry.name );
+}
+
 int find_entry_on_root( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, const BYTE* formattedName, FAT_NODE* ret )
 {
 	BYTE	sector[MAX_SECTOR_SIZE];
@@ -803,12 +1820,15 @@ int find_entry_on_root( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, con
 
 	entriesPerSector	= fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY );
 	lastEntry			= entriesPerSector - 1;
-	lastSector			= fs->bpb.rootEntryCount / entriesPerSector;
+	lastSector			= get_root_dir_sectors( fs ) - 1;
 
 	for( i = first->sector; i <= lastSector; i++ )
 	{
-		read_root_sector( fs, i, sector );
+		if( read_root_sector( fs, i, sector ) )
+			return FAT_READ_ERROR;
 		entry = ( FAT_DIR_ENTRY* )sector;
+		if( IS_ENTRY_NAME( formattedName ) )
+			cache_dir_sector( fs, 0, 0, i, sector );
 
 		result = find_entry_at_sector( sector, formattedName, begin, lastEntry, &number );
 		begin = 0;
@@ -856,8 +1876,11 @@ int find_entry_on_data( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, con
 
 		for( i = first->sector; i < fs->bpb.sectorsPerCluster; i++ )
 		{
-			read_data_sector( fs, currentCluster, i, sector );
+			if( read_data_sector( fs, currentCluster, i, sector ) )
+				return FAT_READ_ERROR;
 			entry = ( FAT_DIR_ENTRY* )sector;
+			if( IS_ENTRY_NAME( formattedName ) )
+				cache_dir_sector( fs, first->cluster, currentCluster, i, sector );
 
 			result = find_entry_at_sector( sector, formattedName, begin, lastEntry, &number );
 			begin = 0;
@@ -899,118 +1922,415 @@ int find_entry_on_data( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, con
 /* entryName = NULL -> Find any valid entry */
 int lookup_entry( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, const BYTE* entryName, FAT_NODE* ret )
 {
+	DENTRY*		dentry;
+	DIR_FILTER*	filter = NULL;
+	BYTE		whole;
+	int			result;
+
+	whole = IS_ENTRY_NAME( entryName ) && first->sector == 0 && first->number == 0;
+
+	/* an entry looked up before is found without reading the directory */
+	if( whole && ( dentry = find_dentry( &fs->dentries, first->cluster, entryName ) ) != NULL )
+	{
+		memcpy( &ret->entry, dentry->entry, sizeof( FAT_DIR_ENTRY ) );
+		ret->location.cluster	= dentry->cluster;
+		ret->location.sector	= dentry->sector;
+		ret->location.number	= dentry->number;
+		ret->fs = fs;
+
+		return FAT_SUCCESS;
+	}
+
+	/* a name the filter of the directory does not hold is not there, without a filter the
+	 * scan collects the names to build one */
+	if( whole && ( filter = find_dir_filter( &fs->filters, first->cluster ) ) != NULL )
+	{
+		if( !dir_filter_may_contain( filter, entryName ) )
+		{
+			fs->filters.negatives++;
+			return FAT_ERROR;
+		}
+	}
+	else if( whole )
+		start_dir_filter( &fs->filters );
+
 	if( first->cluster == 0 && ( fs->FATType == FAT12 || fs->FATType == FAT16 ) )
-		return find_entry_on_root( fs, first, entryName, ret );
+		result = find_entry_on_root( fs, first, entryName, ret );
 	else
-		return find_entry_on_data( fs, first, entryName, ret );
+		result = find_entry_on_data( fs, first, entryName, ret );
+
+	/* a scan that missed the name has read the whole directory, one that failed to read a
+	 * sector has not */
+	if( fs->filters.collecting && result == FAT_ERROR )
+		finish_dir_filter( &fs->filters, first->cluster );
+	else if( fs->filters.collecting )
+		cancel_dir_filter( &fs->filters );
+	else if( filter && result == FAT_ERROR )
+		fs->filters.falsePositives++;
+
+	return result;
+}
+
+int read_dir_sector( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, BYTE* sector )
+{
+	if( IS_FIXED_ROOT( fs, location->cluster ) )
+		return read_root_sector( fs, location->sector, sector );
+
+	return read_data_sector( fs, location->cluster, location->sector, sector );
+}
+
+int write_dir_sector( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, const BYTE* sector )
+{
+	if( IS_FIXED_ROOT( fs, location->cluster ) )
+		return write_root_sector( fs, location->sector, sector );
+
+	return write_data_sector( fs, location->cluster, location->sector, sector );
+}
+
+/* moves a location to the first entry of the next sector of its directory, fails past the last one */
+int next_dir_sector( FAT_FILESYSTEM* fs, FAT_ENTRY_LOCATION* location )
+{
+	DWORD	next;
+
+	location->sector++;
+	location->number = 0;
+
+	if( IS_FIXED_ROOT( fs, location->cluster ) )
+		return location->sector < get_root_dir_sectors( fs ) ? FAT_SUCCESS : FAT_ERROR;
+	if( location->sector < fs->bpb.sectorsPerCluster )
+		return FAT_SUCCESS;
+
+	/* the end of chain, free and bad marks are all out of the cluster range */
+	next = get_fat( fs, location->cluster );
+	if( next < 2 || next >= fs->freeClusters.clusters )
+		return FAT_ERROR;
+
+	location->cluster	= next;
+	location->sector	= 0;
+
+	return FAT_SUCCESS;
+}
+
+int is_past_dir_end( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location )
+{
+	if( IS_FIXED_ROOT( fs, location->cluster ) )
+		return location->sector >= get_root_dir_sectors( fs );
+
+	return location->sector >= fs->bpb.sectorsPerCluster;
+}
+
+/* Walk a directory from a location to its DIR_ENTRY_NO_MORE entry, or past its last entry. The
+ * deleted entries on the way are counted, with stopAtFree the walk stops at the first one.
+ * Returns 1 when it stopped at a deleted entry, 0 at the end */
+int walk_dir_slots( FAT_FILESYSTEM* fs, FAT_ENTRY_LOCATION* location, BYTE stopAtFree, UINT32* freeCount )
+{
+	BYTE	sector[MAX_SECTOR_SIZE];
+	const FAT_DIR_ENTRY*	entry = ( const FAT_DIR_ENTRY* )sector;
+	INT32	entriesPerSector = fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY );
+
+	do
+	{
+		if( read_dir_sector( fs, location, sector ) )
+			return FAT_ERROR;
+
+		for( ; location->number < entriesPerSector; location->number++ )
+		{
+			if( entry[location->number].name[0] == DIR_ENTRY_NO_MORE )
+				return 0;
+
+			if( entry[location->number].name[0] == DIR_ENTRY_FREE )
+			{
+				if( stopAtFree )
+					return 1;
+				( *freeCount )++;
+			}
+		}
+	} while( next_dir_sector( fs, location ) == FAT_SUCCESS );
+
+	return 0;
+}
+
+/* the slots of a directory, the least recently used ones are replaced by a walk of it */
+FAT_DIR_SLOTS* get_dir_slots( FAT_FILESYSTEM* fs, SECTOR parent )
+{
+	FAT_DIR_SLOTS*		slots = &fs->slots[0];
+	FAT_ENTRY_LOCATION	location;
+	UINT32	i;
+	int		result;
+
+	fs->slotsClock++;
+
+	for( i = 0; i < FAT_DIR_SLOTS_COUNT; i++ )
+	{
+		if( fs->slots[i].valid && fs->slots[i].parent == parent )
+		{
+			fs->slots[i].lastUsed = fs->slotsClock;
+			return &fs->slots[i];
+		}
+
+		if( slots->valid && ( !fs->slots[i].valid || fs->slots[i].lastUsed < slots->lastUsed ) )
+			slots = &fs->slots[i];
+	}
+
+	slots->valid		= 0;
+	slots->freeCount	= 0;
+
+	location.cluster	= parent;
+	location.sector		= 0;
+	location.number		= 0;
+
+	result = walk_dir_slots( fs, &location, 1, NULL );
+	if( result == FAT_ERROR )
+		return NULL;
+
+	slots->nextFree = location;
+	if( result == 1 )
+	{
+		slots->freeCount = 1;
+		location.number++;
+		if( walk_dir_slots( fs, &location, 0, &slots->freeCount ) == FAT_ERROR )
+			return NULL;
+	}
+
+	slots->end		= location;
+	slots->parent	= parent;
+	slots->valid	= 1;
+	slots->lastUsed	= fs->slotsClock;
+
+	return slots;
+}
+
+/* an entry of a directory is deleted, without the directory known all slots are walked again */
+void free_dir_slot( FAT_FILESYSTEM* fs, const DENTRY* dentry, const FAT_ENTRY_LOCATION* location )
+{
+	UINT32	i;
+
+	for( i = 0; i < FAT_DIR_SLOTS_COUNT; i++ )
+	{
+		if( !fs->slots[i].valid )
+			continue;
+
+		if( dentry == NULL )
+			fs->slots[i].valid = 0;
+		else if( fs->slots[i].parent == dentry->parent && fs->slots[i].freeCount++ == 0 )
+			fs->slots[i].nextFree = *location;
+	}
+}
+
+void invalidate_dir_slots( FAT_FILESYSTEM* fs, SECTOR parent )
+{
+	UINT32	i;
+
+	for( i = 0; i < FAT_DIR_SLOTS_COUNT; i++ )
+	{
+		if( fs->slots[i].parent == parent )
+			fs->slots[i].valid = 0;
+	}
+}
+
+/* write entries from a location on, all of them in its sector, with one sector write */
+int set_entries( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, const FAT_DIR_ENTRY* values, INT32 count )
+{
+	BYTE	sector[MAX_SECTOR_SIZE];
+	FAT_ENTRY_LOCATION	current = *location;
+	DENTRY*	dentry;
+	INT32	i;
+
+	if( read_dir_sector( fs, location, sector ) )
+		return FAT_ERROR;
+
+	memcpy( &( ( FAT_DIR_ENTRY* )sector )[location->number], values, count * sizeof( FAT_DIR_ENTRY ) );
+
+	if( write_dir_sector( fs, location, sector ) )
+		return FAT_ERROR;
+
+	for( i = 0; i < count; i++, current.number++ )
+	{
+		/* a cached entry follows the one on the disk, a removed or renamed one is dropped */
+		dentry = find_dentry_at( &fs->dentries, current.cluster, current.sector, current.number );
+		if( values[i].name[0] == DIR_ENTRY_FREE )
+			free_dir_slot( fs, dentry, &current );
+
+		if( dentry && memcmp( dentry->name, values[i].name, MAX_ENTRY_NAME_LENGTH ) == 0 )
+			memcpy( dentry->entry, &values[i], sizeof( FAT_DIR_ENTRY ) );
+		else if( dentry )
+			remove_dentry( &fs->dentries, dentry );
+	}
+
+	return FAT_SUCCESS;
 }
 
 int set_entry( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, const FAT_DIR_ENTRY* value )
+{
+	return set_entries( fs, location, value, 1 );
+}
+
+int get_entry( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, FAT_DIR_ENTRY* value )
 {
 	BYTE	sector[MAX_SECTOR_SIZE];
-	FAT_DIR_ENTRY*	entry;
 
 	if( location->cluster == 0 && ( fs->FATType == FAT12 || fs->FATType == FAT16 ) )
 	{
-		read_root_sector( fs, location->sector, sector );
+		if( read_root_sector( fs, location->sector, sector ) )
+			return FAT_ERROR;
+	}
+	else if( read_data_sector( fs, location->cluster, location->sector, sector ) )
+		return FAT_ERROR;
+
+	*value = ( ( FAT_DIR_ENTRY* )sector )[location->number];
+	return FAT_SUCCESS;
+}
+
+FAT_DELAYED_WRITE* find_delayed_write( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location )
+{
+	FAT_DELAYED_WRITE*	pending;
+
+	for( pending = fs->delayed; pending; pending = pending->next )
+	{
+		if( pending->location.cluster == location->cluster && pending->location.sector == location->sector &&
+			pending->location.number == location->number )
+			break;
+	}
+
+	return pending;
+}
+
+/* the size of a file includes its data waiting for clusters */
+void apply_delayed_size( FAT_FILESYSTEM* fs, FAT_NODE* node )
+{
+	FAT_DELAYED_WRITE*	pending;
 
-		entry = ( FAT_DIR_ENTRY* )sector;
-		entry[location->number] = *value;
+	if( fs->delayed && ( pending = find_delayed_write( fs, &node->location ) ) != NULL )
+		node->entry.fileSize = MAX( node->entry.fileSize, pending->start + pending->length );
+}
 
-		write_root_sector( fs, location->sector, sector );
-	}
-	else
-	{
-		read_data_sector( fs, location->cluster, location->sector, sector );
+/* a node looked up before its delayed data was flushed has no first cluster yet */
+void refresh_delayed_node( FAT_NODE* file )
+{
+	FAT_DIR_ENTRY	entry;
 
-		entry = ( FAT_DIR_ENTRY* )sector;
-		entry[location->number] = *value;
+	if( !( file->fs->options.flags & FAT_MOUNT_DELAYED_ALLOC ) )
+		return;
 
-		write_data_sector( fs, location->cluster, location->sector, sector );
+	if( GET_FIRST_CLUSTER( file->entry ) == 0 && get_entry( file->fs, &file->location, &entry ) == FAT_SUCCESS &&
+		memcmp( entry.name, file->entry.name, MAX_ENTRY_NAME_LENGTH ) == 0 )
+	{
+		SET_FIRST_CLUSTER( file->entry, GET_FIRST_CLUSTER( entry ) );
+		file->entry.fileSize = MAX( file->entry.fileSize, entry.fileSize );
 	}
 
-	return FAT_ERROR;
+	apply_delayed_size( file->fs, file );
 }
 
+/* A new entry reuses a deleted one of the directory or goes to its end, found from the slots of
+ * the directory without walking it. Only the sectors of the entry and of the new end of entries
+ * are written, one sector when they share it */
 int insert_entry( const FAT_NODE* parent, FAT_NODE* newEntry, BYTE overwrite )
 {
-	FAT_ENTRY_LOCATION	begin;
-	FAT_NODE			entryNoMore;
-	BYTE				entryName[2] = { 0, };
+	FAT_FILESYSTEM*		fs = parent->fs;
+	FAT_ENTRY_LOCATION	begin, end;
+	FAT_DIR_ENTRY		entries[2];
+	FAT_DIR_SLOTS*		slots;
+	SECTOR				next;
+	int					result;
 
 	begin.cluster = GET_FIRST_CLUSTER( parent->entry );
 	begin.sector = 0;
 	begin.number = 0;
 
-	if( !( IS_POINT_ROOT_ENTRY( parent->entry ) && ( parent->fs->FATType == FAT12 || parent->fs->FATType == FAT16 ) ) && overwrite )
-	{
-		begin.number = 0;
+	/* the end of entries follows the new entry */
+	ZeroMemory( entries, sizeof( entries ) );
+	entries[0] = newEntry->entry;
+	entries[1].name[0] = DIR_ENTRY_NO_MORE;
 
-		set_entry( parent->fs, &begin, &newEntry->entry );
+	if( !( IS_POINT_ROOT_ENTRY( parent->entry ) && ( fs->FATType == FAT12 || fs->FATType == FAT16 ) ) && overwrite )
+	{
 		newEntry->location = begin;
+		if( set_entries( fs, &begin, entries, 2 ) )
+			return FAT_ERROR;
 
-		/* End of entries */
-		begin.number = 1;
-		ZeroMemory( &entryNoMore, sizeof( FAT_NODE ) );
-		entryNoMore.entry.name[0] = DIR_ENTRY_NO_MORE;
-		set_entry( parent->fs, &begin, &entryNoMore.entry );
-
+		cache_inserted_entry( fs, begin.cluster, newEntry );
 		return FAT_SUCCESS;
 	}
 
-	/* find empty(unused) entry */
-	entryName[0] = DIR_ENTRY_FREE;
-	if( lookup_entry( parent->fs, &begin, entryName, &entryNoMore ) == FAT_SUCCESS )
+	slots = get_dir_slots( fs, begin.cluster );
+	if( slots == NULL )
+		return FAT_ERROR;
+
+	/* a deleted entry is reused first, the next one is searched from it on */
+	if( slots->freeCount )
 	{
-		set_entry( parent->fs, &entryNoMore.location, &newEntry->entry );
-		newEntry->location = entryNoMore.location;
+		newEntry->location = slots->nextFree;
+		if( set_entry( fs, &newEntry->location, &newEntry->entry ) )
+			return FAT_ERROR;
+
+		cache_inserted_entry( fs, begin.cluster, newEntry );
+
+		/* the deleted entries left are before the one used, the directory is walked again */
+		slots->nextFree.number++;
+		if( --slots->freeCount && walk_dir_slots( fs, &slots->nextFree, 1, NULL ) != 1 )
+			slots->valid = 0;
+
+		return FAT_SUCCESS;
 	}
-	else
+
+	newEntry->location = slots->end;
+	if( is_past_dir_end( fs, &newEntry->location ) )
 	{
-		if( IS_POINT_ROOT_ENTRY( parent->entry ) && ( parent->fs->FATType == FAT12 || parent->fs->FATType == FAT16 ) )
+		if( IS_FIXED_ROOT( fs, begin.cluster ) )
 		{
-			UINT32	rootEntryCount = newEntry->location.sector * ( parent->fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY ) ) + newEntry->location.number;
-			if( rootEntryCount >= parent->fs->bpb.rootEntryCount )
-			{
-				WARNING( "Cannot insert entry into the root entry\n" );
-				return FAT_ERROR;
-			}
+			WARNING( "Cannot insert entry into the root entry\n" );
+			return FAT_ERROR;
 		}
 
-		/* add new entry to end */
-		entryName[0] = DIR_ENTRY_NO_MORE;
-		if( lookup_entry( parent->fs, &begin, entryName, &entryNoMore ) == FAT_ERROR )
+		/* a directory full to the end of its chain without an end of entries */
+		newEntry->location.cluster = span_cluster_chain( fs, newEntry->location.cluster );
+		if( newEntry->location.cluster == 0 )
+		{
+			NO_MORE_CLUSER();
 			return FAT_ERROR;
+		}
+		newEntry->location.sector = 0;
+		newEntry->location.number = 0;
+	}
 
-		set_entry( parent->fs, &entryNoMore.location, &newEntry->entry );
-		newEntry->location = entryNoMore.location;
-		entryNoMore.location.number++;
+	end = newEntry->location;
+	end.number++;
 
-		if( entryNoMore.location.number == ( parent->fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY ) ) )
-		{
-			entryNoMore.location.sector++;
-			entryNoMore.location.number = 0;
+	if( end.number < ( INT32 )( fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY ) ) )
+		result = set_entries( fs, &newEntry->location, entries, 2 );
+	else
+	{
+		result = set_entry( fs, &newEntry->location, &newEntry->entry );
 
-			if( entryNoMore.location.sector == parent->fs->bpb.sectorsPerCluster )
+		/* A full root has no end of entries, a full cluster is followed by a new one. Without a
+		 * free cluster the directory ends with its chain and end stays past it */
+		end = newEntry->location;
+		if( result == FAT_SUCCESS && next_dir_sector( fs, &end ) && !IS_FIXED_ROOT( fs, end.cluster ) )
+		{
+			next = span_cluster_chain( fs, end.cluster );
+			if( next == 0 )
 			{
-				if( !( IS_POINT_ROOT_ENTRY( parent->entry ) && ( parent->fs->FATType == FAT12 || parent->fs->FATType == FAT16 ) ) )
-				{
-					entryNoMore.location.cluster = span_cluster_chain( parent->fs, entryNoMore.location.cluster );
-
-					if( entryNoMore.location.cluster == 0 )
-					{
-						NO_MORE_CLUSER();
-						return FAT_ERROR;
-					}
-					entryNoMore.location.sector = 0;
-				}
+				NO_MORE_CLUSER();
+			}
+			else
+			{
+				end.cluster	= next;
+				end.sector	= 0;
+				end.number	= 0;
 			}
 		}
 
-		/* End of entries */
-		set_entry( parent->fs, &entryNoMore.location, &entryNoMore.entry );
+		if( result == FAT_SUCCESS && !is_past_dir_end( fs, &end ) )
+			result = set_entry( fs, &end, &entries[1] );
 	}
 
+	if( result )
+		return FAT_ERROR;
+
+	slots->end = end;
+	cache_inserted_entry( fs, begin.cluster, newEntry );
+
 	return FAT_SUCCESS;
 }
 
@@ -1087,6 +2407,7 @@ int format_name( FAT_FILESYSTEM* fs, char* name )
 int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
 {
 	FAT_NODE		dotNode, dotdotNode;
+	FAT_ENTRY_LOCATION	first;
 	DWORD			firstCluster;
 	BYTE			name[MAX_NAME_LENGTH];
 	int				result;
@@ -1096,6 +2417,13 @@ int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
 	if( format_name( parent->fs, name ) )
 		return FAT_ERROR;
 
+	/* like fat_create(), an existing name is not inserted again, nor one that may exist */
+	first.cluster = GET_FIRST_CLUSTER( parent->entry );
+	first.sector = 0;
+	first.number = 0;
+	if( lookup_entry( parent->fs, &first, name, &dotNode ) != FAT_ERROR )
+		return FAT_ERROR;
+
 	/* newEntry */
 	ZeroMemory( ret, sizeof( FAT_NODE ) );
 	memcpy( ret->entry.name, name, MAX_ENTRY_NAME_LENGTH );
@@ -1136,19 +2464,43 @@ int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
 	return FAT_SUCCESS;
 }
 
+/* Free a chain in the in-memory FAT and write every FAT sector it touched once at the end.
+ * The freed clusters go back to the allocator a contiguous run at a time */
 int free_cluster_chain( FAT_FILESYSTEM* fs, DWORD firstCluster )
 {
 	DWORD	currentCluster = firstCluster;
 	DWORD	nextCluster;
+	DWORD	runFirst = 0;
+	UINT32	runLength = 0;
+
+	invalidate_extent_map( &fs->extents, firstCluster );
 
-	while( !is_EOC( fs->FATType, currentCluster ) && currentCluster != FREE_CLUSTER )
+	/* the end of chain, free and bad marks are all out of the cluster range */
+	while( currentCluster >= 2 && currentCluster < fs->freeClusters.clusters )
 	{
 		nextCluster = get_fat( fs, currentCluster );
-		set_fat( fs, currentCluster, FREE_CLUSTER );
-		add_free_cluster( fs, currentCluster );
+		update_fat( fs, currentCluster, FREE_CLUSTER );
+
+		if( runLength && runFirst + runLength == currentCluster )
+			runLength++;
+		else
+		{
+			if( runLength )
+				add_free_clusters( fs, runFirst, runLength );
+			runFirst	= currentCluster;
+			runLength	= 1;
+		}
+
 		currentCluster = nextCluster;
 	}
 
+	if( runLength )
+		add_free_clusters( fs, runFirst, runLength );
+
+	/* without write-back the change reaches the disk right away, like set_fat() */
+	if( !fs->cache.writeBack )
+		return flush_fat( fs, 0 );
+
 	return FAT_SUCCESS;
 }
 
@@ -1160,7 +2512,8 @@ int has_sub_entries( FAT_FILESYSTEM* fs, const FAT_DIR_ENTRY* entry )
 	begin = get_entry_location( entry );
 	begin.number = 2;		/* Ignore the '.' and '..' entries */
 
-	if( !lookup_entry( fs, &begin, NULL, &subEntry ) )
+	/* a directory that can not be read is not known to be empty */
+	if( lookup_entry( fs, &begin, NULL, &subEntry ) != FAT_ERROR )
 		return FAT_ERROR;
 
 	return FAT_SUCCESS;
@@ -1171,14 +2524,25 @@ int has_sub_entries( FAT_FILESYSTEM* fs, const FAT_DIR_ENTRY* entry )
 /******************************************************************************/
 int fat_rmdir( FAT_NODE* dir )
 {
+	BYTE	first;
+
 	if( has_sub_entries( dir->fs, &dir->entry ) )
 		return FAT_ERROR;
 
 	if( !( dir->entry.attribute & ATTR_DIRECTORY ) )		/* Is directory? */
 		return FAT_ERROR;
 
+	first = dir->entry.name[0];
 	dir->entry.name[0] = DIR_ENTRY_FREE;
-	set_entry( dir->fs, &dir->location, &dir->entry );
+	if( set_entry( dir->fs, &dir->location, &dir->entry ) )
+	{
+		dir->entry.name[0] = first;
+		return FAT_ERROR;
+	}
+
+	invalidate_dentry_dir( &dir->fs->dentries, GET_FIRST_CLUSTER( dir->entry ) );
+	invalidate_dir_filter( &dir->fs->filters, GET_FIRST_CLUSTER( dir->entry ) );
+	invalidate_dir_slots( dir->fs, GET_FIRST_CLUSTER( dir->entry ) );
 	free_cluster_chain( dir->fs, GET_FIRST_CLUSTER( dir->entry ) );
 
 	return FAT_SUCCESS;
@@ -1204,7 +2568,11 @@ int fat_lookup( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 	if( IS_POINT_ROOT_ENTRY( parent->entry ) )
 		begin.cluster = 0;
 
-	return lookup_entry( parent->fs, &begin, formattedName, retEntry );
+	if( lookup_entry( parent->fs, &begin, formattedName, retEntry ) )
+		return FAT_ERROR;
+
+	apply_delayed_size( parent->fs, retEntry );
+	return FAT_SUCCESS;
 }
 
 /******************************************************************************/
@@ -1228,7 +2596,7 @@ int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 	first.cluster = parent->entry.firstClusterLO;
 	first.sector = 0;
 	first.number = 0;
-	if( lookup_entry( parent->fs, &first, name, retEntry ) == FAT_SUCCESS )
+	if( lookup_entry( parent->fs, &first, name, retEntry ) != FAT_ERROR )
 		return FAT_ERROR;
 
 	retEntry->fs = parent->fs;
@@ -1244,50 +2612,82 @@ int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 /******************************************************************************/
 int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char* buffer )
 {
-	BYTE	sector[MAX_SECTOR_SIZE];
-	DWORD	currentOffset, currentCluster, clusterSeq = 0;
-	DWORD	clusterNumber, sectorNumber, sectorOffset;
-	DWORD	readEnd;
-	DWORD	clusterSize, clusterOffset = 0;
+	BYTE	head[MAX_SECTOR_SIZE], tail[MAX_SECTOR_SIZE];
+	DWORD	currentOffset, currentCluster, firstCluster;
+	DWORD	readEnd, lastCluster;
+	DWORD	clusterSize;
+	UINT32	run;
+	DWORD	diskEnd;
+	FAT_DELAYED_WRITE*	pending;
+	CLUSTER_TRANSFER	transfers[FAT_IO_BATCH];
+	DISK_REQUEST		requests[FAT_IO_BATCH];
+	int		i, count;
+
+	finish_fat_scan( file->fs, 0 );
+	refresh_delayed_node( file );
 
-	currentCluster = GET_FIRST_CLUSTER( file->entry );
+	firstCluster = GET_FIRST_CLUSTER( file->entry );
 	readEnd = MIN( offset + length, file->entry.fileSize );
 
+	/* the data past the clusters of the file is still in memory */
+	pending = file->fs->delayed ? find_delayed_write( file->fs, &file->location ) : NULL;
+	if( pending )
+		readEnd = MIN( readEnd, pending->start + pending->length );
+	diskEnd = pending ? MIN( readEnd, pending->start ) : readEnd;
+
 	currentOffset = offset;
 
 	clusterSize = ( file->fs->bpb.bytesPerSector * file->fs->bpb.sectorsPerCluster );
-	clusterOffset = clusterSize;
-	while( offset > clusterOffset )
-	{
-		currentCluster = get_fat( file->fs, currentCluster );
-		clusterOffset += clusterSize;
-		clusterSeq++;
-	}
+	lastCluster = diskEnd ? ( diskEnd - 1 ) / clusterSize : 0;
 
-	while( currentOffset < readEnd )
+	while( currentOffset < diskEnd )
 	{
-		DWORD	copyLength;
-
-		clusterNumber	= currentOffset / ( file->fs->bpb.bytesPerSector * file->fs->bpb.sectorsPerCluster );
-		if( clusterSeq != clusterNumber )
+		/* queue a batch of runs before waiting for any of them, a contiguous file is one run */
+		for( count = 0; count < FAT_IO_BATCH && currentOffset < diskEnd; count++ )
 		{
-			clusterSeq++;
-			currentCluster = get_fat( file->fs, currentCluster );
+			if( get_file_run( file->fs, firstCluster, currentOffset / clusterSize, lastCluster, &currentCluster, &run ) )
+				break;
+
+			prepare_cluster_transfer( file->fs, currentOffset, diskEnd, run, ( BYTE* )buffer, head, tail, &transfers[count] );
+			set_cluster_request( file->fs, currentCluster, &transfers[count], 0, &requests[count] );
+
+			transfers[count].buffer = buffer;
+			buffer += transfers[count].length;
+			currentOffset += transfers[count].length;
 		}
-		sectorNumber	= ( currentOffset / ( file->fs->bpb.bytesPerSector ) ) % file->fs->bpb.sectorsPerCluster;
-		sectorOffset	= currentOffset % file->fs->bpb.bytesPerSector;
 
-		if( read_data_sector( file->fs, currentCluster, sectorNumber, sector ) )
+		if( count == 0 )
 			break;
 
-		copyLength = MIN( file->fs->bpb.bytesPerSector - sectorOffset, readEnd - currentOffset );
+		disk_transfer_requests( file->fs->disk, requests, count );
+
+		for( i = 0; i < count; i++ )
+		{
+			if( requests[i].result )
+				break;
+
+			/* sectors written back later are newer in the cache than on the disk */
+			cache_overlay_sectors( &file->fs->cache, requests[i].sector, requests[i].iov, requests[i].iovCount );
+
+			if( transfers[i].headLength )
+				memcpy( transfers[i].buffer, &head[transfers[i].headOffset], transfers[i].headLength );
+			if( transfers[i].tailLength )
+				memcpy( transfers[i].buffer + transfers[i].length - transfers[i].tailLength, tail, transfers[i].tailLength );
+		}
 
-		memcpy( buffer,
-				&sector[sectorOffset],
-				copyLength );
+		/* only the transfers before the first failed one were read */
+		if( i < count )
+		{
+			for( ; i < count; i++ )
+				currentOffset -= transfers[i].length;
+			break;
+		}
+	}
 
-		buffer += copyLength;
-		currentOffset += copyLength;
+	if( pending && currentOffset >= diskEnd && currentOffset < readEnd )
+	{
+		memcpy( buffer, pending->data + currentOffset - pending->start, readEnd - currentOffset );
+		currentOffset = readEnd;
 	}
 
 	return currentOffset - offset;
@@ -1296,84 +2696,120 @@ int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char*
 /******************************************************************************/
 /* Write file                                                                 */
 /******************************************************************************/
-int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer )
+/* write through the clusters of the file, the missing ones are allocated first */
+int write_file( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer )
 {
-	BYTE	sector[MAX_SECTOR_SIZE];
-	DWORD	currentOffset, currentCluster, clusterSeq = 0;
-	DWORD	clusterNumber, sectorNumber, sectorOffset;
-	DWORD	readEnd;
+	BYTE	head[MAX_SECTOR_SIZE], tail[MAX_SECTOR_SIZE];
+	DWORD	currentOffset, currentCluster, firstCluster;
+	DWORD	readEnd, lastCluster;
 	DWORD	clusterSize;
+	UINT32	run;
+	EXTENT_MAP*			map;
+	CLUSTER_TRANSFER	transfers[FAT_IO_BATCH];
+	DISK_REQUEST		requests[FAT_IO_BATCH];
+	CLUSTER_TRANSFER*	transfer;
+	int		i, count, result, stop = 0;
 
-	currentCluster = GET_FIRST_CLUSTER( file->entry );
+	finish_fat_scan( file->fs, 0 );
+
+	firstCluster = GET_FIRST_CLUSTER( file->entry );
 	readEnd = offset + length;
 
 	currentOffset = offset;
 
 	clusterSize = ( file->fs->bpb.bytesPerSector * file->fs->bpb.sectorsPerCluster );
-	while( offset > clusterSize )
-	{
-		currentCluster = get_fat( file->fs, currentCluster );
-		clusterSize += clusterSize;
-		clusterSeq++;
-	}
+	lastCluster = readEnd ? ( readEnd - 1 ) / clusterSize : 0;
 
-	while( currentOffset < readEnd )
+	/* the clusters missing for the write are allocated at once to keep them contiguous, a
+	 * write past the free space stops where the allocated clusters end */
+	if( currentOffset < readEnd && firstCluster == 0 )
 	{
-		DWORD	copyLength;
+		firstCluster = alloc_cluster_chain( file->fs, 0, lastCluster + 1 );
+		if( firstCluster == 0 )
+		{
+			NO_MORE_CLUSER();
+			return FAT_ERROR;
+		}
 
-		clusterNumber	= currentOffset / ( file->fs->bpb.bytesPerSector * file->fs->bpb.sectorsPerCluster );
+		SET_FIRST_CLUSTER( file->entry, firstCluster );
+	}
+	else if( currentOffset < readEnd && map_file_chain( file->fs, firstCluster, lastCluster, &map ) && map->clusters )
+		alloc_cluster_chain( file->fs, get_last_extent_cluster( map ), lastCluster + 1 - map->clusters );
 
-		if( currentCluster == 0 )
+	while( currentOffset < readEnd && !stop )
+	{
+		/* queue a batch of runs before waiting for any of them, a contiguous file is one run */
+		for( count = 0; count < FAT_IO_BATCH && currentOffset < readEnd; count++ )
 		{
-			currentCluster = alloc_free_cluster( file->fs );
-			if( currentCluster == 0 )
+			if( get_file_run( file->fs, firstCluster, currentOffset / clusterSize, lastCluster, &currentCluster, &run ) )
 			{
 				NO_MORE_CLUSER();
-				return FAT_ERROR;
+				stop = 1;
+				break;
 			}
 
-			SET_FIRST_CLUSTER( file->entry, currentCluster );
-			set_fat( file->fs, currentCluster, get_MS_EOC( file->fs->FATType ) );
-		}
-
-		if( clusterSeq != clusterNumber )
-		{
-			DWORD nextCluster;
-			clusterSeq++;
+			transfer = &transfers[count];
+			prepare_cluster_transfer( file->fs, currentOffset, readEnd, run, ( BYTE* )buffer, head, tail, transfer );
 
-			nextCluster = get_fat( file->fs, currentCluster );
-			if( is_EOC( file->fs->FATType, nextCluster ) )
+			/* partial sectors keep the bytes around the written range */
+			if( transfer->headLength )
+			{
+				if( read_data_sector( file->fs, currentCluster, transfer->sectorNumber, head ) )
+				{
+					stop = 1;
+					break;
+				}
+				memcpy( &head[transfer->headOffset], buffer, transfer->headLength );
+			}
+			if( transfer->tailLength )
 			{
-				nextCluster = span_cluster_chain( file->fs, currentCluster );
+				if( read_data_sector( file->fs, currentCluster, transfer->sectorNumber + transfer->sectorCount - 1, tail ) )
+				{
+					stop = 1;
+					break;
+				}
+				memcpy( tail, buffer + transfer->length - transfer->tailLength, transfer->tailLength );
+			}
 
-				if( nextCluster == 0 )
+			/* a write inside one sector stays in the cache until it is written back */
+			if( file->fs->cache.writeBack && transfer->sectorCount == 1 && transfer->length < file->fs->bpb.bytesPerSector )
+			{
+				if( cache_write_sector( &file->fs->cache, calc_physical_sector( file->fs, currentCluster, transfer->sectorNumber ),
+						transfer->headLength ? head : tail, SECTOR_DATA ) )
 				{
-					NO_MORE_CLUSER();
+					stop = 1;
 					break;
 				}
+
+				buffer += transfer->length;
+				currentOffset += transfer->length;
+				count--;
+				continue;
 			}
-			currentCluster = nextCluster;
-		}
-		sectorNumber	= ( currentOffset / ( file->fs->bpb.bytesPerSector ) ) % file->fs->bpb.sectorsPerCluster;
-		sectorOffset	= currentOffset % file->fs->bpb.bytesPerSector;
 
-		copyLength = MIN( file->fs->bpb.bytesPerSector - sectorOffset, readEnd - currentOffset );
+			set_cluster_request( file->fs, currentCluster, transfer, 1, &requests[count] );
 
-		if( copyLength != file->fs->bpb.bytesPerSector )
-		{
-			if( read_data_sector( file->fs, currentCluster, sectorNumber, sector ) )
-				break;
+			buffer += transfer->length;
+			currentOffset += transfer->length;
 		}
 
-		memcpy( &sector[sectorOffset],
-				buffer,
-				copyLength );
-
-		if( write_data_sector( file->fs, currentCluster, sectorNumber, sector ) )
+		if( count == 0 )
 			break;
 
-		buffer += copyLength;
-		currentOffset += copyLength;
+		/* only the transfers before the first failed one were written */
+		result = disk_transfer_requests( file->fs->disk, requests, count );
+
+		for( i = 0; i < count; i++ )
+			cache_invalidate_sectors( &file->fs->cache, requests[i].sector, transfers[i].sectorCount );
+
+		if( result )
+		{
+			for( i = 0; i < count && requests[i].result == 0; i++ )
+				;
+			for( ; i < count; i++ )
+				currentOffset -= transfers[i].length;
+			break;
+		}
 	}
 
 	file->entry.fileSize = MAX( currentOffset, file->entry.fileSize );
@@ -1382,16 +2818,372 @@ int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const
 	return currentOffset - offset;
 }
 
+void unlink_delayed_write( FAT_FILESYSTEM* fs, FAT_DELAYED_WRITE* pending )
+{
+	FAT_DELAYED_WRITE**	link;
+
+	for( link = &fs->delayed; *link != pending; link = &( *link )->next )
+		;
+	*link = pending->next;
+
+	fs->delayedBytes	-= pending->length;
+	fs->delayedClusters	-= pending->clusters;
+}
+
+/* Buffer data written at offset, past start where the clusters of the file end. Fails when the
+ * clusters for it can not be reserved */
+int add_delayed_write( FAT_NODE* file, DWORD start, DWORD offset, DWORD length, const char* buffer )
+{
+	FAT_FILESYSTEM*		fs = file->fs;
+	FAT_DELAYED_WRITE*	pending;
+	DWORD		clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	DWORD		end, size;
+	UINT32		clusters;
+	BYTE*		data;
+
+	pending = find_delayed_write( fs, &file->location );
+	if( pending == NULL )
+	{
+		pending = ( FAT_DELAYED_WRITE* )calloc( 1, sizeof( FAT_DELAYED_WRITE ) );
+		if( pending == NULL )
+			return FAT_ERROR;
+
+		pending->location	= file->location;
+		pending->start		= start;
+		pending->next		= fs->delayed;
+		fs->delayed			= pending;
+	}
+
+	end			= MAX( pending->length, offset + length - pending->start );
+	clusters	= ( end + clusterSize - 1 ) / clusterSize;
+
+	if( fs->info32.freeCount < fs->delayedClusters + clusters - pending->clusters )
+		goto fail;
+
+	if( end > pending->size )
+	{
+		size = MAX( pending->size * 2, MAX( end, clusterSize ) );
+		data = ( BYTE* )realloc( pending->data, size );
+		if( data == NULL )
+			goto fail;
+
+		pending->data = data;
+		pending->size = size;
+	}
+
+	/* a write past the end of the buffered data leaves zeros between */
+	if( offset - pending->start > pending->length )
+		memset( pending->data + pending->length, 0, offset - pending->start - pending->length );
+	memcpy( pending->data + offset - pending->start, buffer, length );
+
+	fs->delayedBytes	+= end - pending->length;
+	fs->delayedClusters	+= clusters - pending->clusters;
+	pending->length		= end;
+	pending->clusters	= clusters;
+
+	return FAT_SUCCESS;
+
+fail:
+	if( pending->length == 0 )
+	{
+		unlink_delayed_write( fs, pending );
+		free( pending->data );
+		free( pending );
+	}
+
+	return FAT_ERROR;
+}
+
+/* Allocate the clusters of the delayed data of a file as one run and write it. The reservation
+ * of the data is given back first so the write can use it. When the data is not all written it
+ * stays buffered, the next flush writes it again over the clusters allocated now */
+int flush_delayed_write( FAT_FILESYSTEM* fs, FAT_DELAYED_WRITE* pending )
+{
+	FAT_NODE	node;
+
+	unlink_delayed_write( fs, pending );
+
+	node.fs			= fs;
+	node.location	= pending->location;
+	if( get_entry( fs, &node.location, &node.entry ) == FAT_SUCCESS &&
+		write_file( &node, pending->start, pending->length, ( const char* )pending->data ) == ( int )pending->length )
+	{
+		free( pending->data );
+		free( pending );
+		return FAT_SUCCESS;
+	}
+
+	pending->clusters	= MIN( pending->clusters, get_available_clusters( fs ) );
+	pending->next		= fs->delayed;
+	fs->delayed			= pending;
+	fs->delayedBytes	+= pending->length;
+	fs->delayedClusters	+= pending->clusters;
+
+	return FAT_ERROR;
+}
+
+/* a delayed write that fails is kept at the head of the list, it is not tried again here */
+int flush_delayed_writes( FAT_FILESYSTEM* fs )
+{
+	FAT_DELAYED_WRITE*	pending;
+	FAT_DELAYED_WRITE*	next;
+	int	result = FAT_SUCCESS;
+
+	for( pending = fs->delayed; pending; pending = next )
+	{
+		next = pending->next;
+		if( flush_delayed_write( fs, pending ) )
+			result = FAT_ERROR;
+	}
+
+	return result;
+}
+
+/* the delayed data left after a failed flush at unmount */
+void release_delayed_writes( FAT_FILESYSTEM* fs )
+{
+	FAT_DELAYED_WRITE*	pending;
+
+	while( fs->delayed )
+	{
+		pending = fs->delayed;
+		unlink_delayed_write( fs, pending );
+		free( pending->data );
+		free( pending );
+	}
+}
+
+/* With FAT_MOUNT_DELAYED_ALLOC the part of a write past the clusters of the file is buffered and
+ * the clusters are allocated when it is flushed, by fat_sync() or when the buffered data grows
+ * over the dirty limit of the cache */
+int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer )
+{
+	FAT_FILESYSTEM*		fs = file->fs;
+	FAT_DELAYED_WRITE*	pending;
+	EXTENT_MAP*	map;
+	DWORD		clusterSize, allocated, fileSize;
+	int			written = 0, result;
+
+	if( !( fs->options.flags & FAT_MOUNT_DELAYED_ALLOC ) || length == 0 )
+		return write_file( file, offset, length, buffer );
+
+	finish_fat_scan( fs, 0 );
+	refresh_delayed_node( file );
+
+	/* where the clusters of the file end */
+	clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	pending = find_delayed_write( fs, &file->location );
+	if( pending )
+		allocated = pending->start;
+	else if( GET_FIRST_CLUSTER( file->entry ) == 0 )
+		allocated = 0;
+	else if( map_file_chain( fs, GET_FIRST_CLUSTER( file->entry ), ( offset + length - 1 ) / clusterSize, &map ) == FAT_SUCCESS )
+		return write_file( file, offset, length, buffer );
+	else
+		allocated = map->clusters * clusterSize;
+
+	/* the size on the disk does not cover the buffered data until it has clusters */
+	if( offset < allocated )
+	{
+		fileSize = file->entry.fileSize;
+		file->entry.fileSize = MIN( fileSize, allocated );
+		written = write_file( file, offset, MIN( length, allocated - offset ), buffer );
+		file->entry.fileSize = MAX( fileSize, file->entry.fileSize );
+
+		if( written < 0 || ( DWORD )written < MIN( length, allocated - offset ) )
+			return written;
+
+		offset	+= written;
+		length	-= written;
+		buffer	+= written;
+		if( length == 0 )
+			return written;
+	}
+
+	/* without clusters reserved for it the write takes what is left now */
+	if( add_delayed_write( file, allocated, offset, length, buffer ) )
+	{
+		flush_delayed_writes( fs );
+		refresh_delayed_node( file );
+
+		result = write_file( file, offset, length, buffer );
+		if( result < 0 )
+			return written ? written : result;
+		return written + result;
+	}
+
+	file->entry.fileSize = MAX( file->entry.fileSize, offset + length );
+
+	if( fs->delayedBytes > fs->cache.dirtyLimit * fs->bpb.bytesPerSector )
+		flush_delayed_writes( fs );
+
+	return written + length;
+}
+
+/******************************************************************************/
+/* Preallocate file                                                           */
+/******************************************************************************/
+/* write zeros to the clusters of a file from the logical cluster first through last */
+int zero_file_clusters( FAT_FILESYSTEM* fs, SECTOR firstCluster, UINT32 first, UINT32 last )
+{
+	BYTE*	zeros;
+	SECTOR	cluster, sector;
+	UINT32	run, sectors, count;
+	int		result = FAT_SUCCESS;
+
+	zeros = ( BYTE* )calloc( FAT_ZERO_SECTORS, fs->bpb.bytesPerSector );
+	if( zeros == NULL )
+		return FAT_ERROR;
+
+	while( first <= last && result == FAT_SUCCESS )
+	{
+		if( get_file_run( fs, firstCluster, first, last, &cluster, &run ) )
+		{
+			result = FAT_ERROR;
+			break;
+		}
+
+		sector	= calc_physical_sector( fs, cluster, 0 );
+		sectors	= run * fs->bpb.sectorsPerCluster;
+		for( ; sectors; sector += count, sectors -= count )
+		{
+			count = MIN( sectors, FAT_ZERO_SECTORS );
+			if( fs->disk->write_sectors( fs->disk, sector, count, zeros ) )
+			{
+				result = FAT_ERROR;
+				break;
+			}
+
+			/* the sectors may still be cached for the file that freed the clusters */
+			cache_invalidate_sectors( &fs->cache, sector, count );
+		}
+
+		first += run;
+	}
+
+	free( zeros );
+	return result;
+}
+
+/* Reserve the clusters for the first length bytes of a file at once, in as few contiguous runs
+ * as the free space allows, or nothing when there is not enough of it. FAT_PREALLOC_ZERO makes
+ * the reserved bytes read as zeros, otherwise their contents are undefined. The file grows to
+ * length unless FAT_PREALLOC_KEEP_SIZE is set, later writes past its size use the clusters */
+int fat_preallocate( FAT_NODE* file, unsigned long length, DWORD flags )
+{
+	FAT_FILESYSTEM*	fs = file->fs;
+	DWORD		clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	DWORD		firstCluster, lastCluster, end;
+	UINT32		chainClusters = 0;
+	EXTENT_MAP*	map;
+	FAT_DELAYED_WRITE*	pending;
+	char*		zeros;
+	int			result = FAT_SUCCESS;
+
+	if( ( file->entry.attribute & ATTR_DIRECTORY ) || length == 0 )
+		return length == 0 ? FAT_SUCCESS : FAT_ERROR;
+
+	/* the size of a file is a DWORD */
+	if( length > 0xFFFFFFFF )
+		return FAT_ERROR;
+
+	wait_free_count( fs );
+
+	/* the reserved clusters follow the delayed data */
+	if( fs->delayed && ( pending = find_delayed_write( fs, &file->location ) ) != NULL &&
+		flush_delayed_write( fs, pending ) )
+		return FAT_ERROR;
+	refresh_delayed_node( file );
+
+	firstCluster	= GET_FIRST_CLUSTER( file->entry );
+	lastCluster		= ( length - 1 ) / clusterSize;
+
+	if( firstCluster && map_file_chain( fs, firstCluster, lastCluster, &map ) == FAT_SUCCESS )
+		chainClusters = lastCluster + 1;
+	else if( firstCluster )
+		chainClusters = map->clusters;
+
+	if( chainClusters <= lastCluster )
+	{
+		if( lastCluster + 1 - chainClusters > get_available_clusters( fs ) )
+		{
+			NO_MORE_CLUSER();
+			return FAT_ERROR;
+		}
+
+		if( firstCluster == 0 )
+		{
+			firstCluster = alloc_cluster_chain( fs, 0, lastCluster + 1 );
+			SET_FIRST_CLUSTER( file->entry, firstCluster );
+		}
+		else
+			alloc_cluster_chain( fs, get_last_extent_cluster( map ), lastCluster + 1 - chainClusters );
+
+		/* only a wrong FSInfo free count leaves the chain short, the file keeps what it got */
+		if( firstCluster == 0 || map_file_chain( fs, firstCluster, lastCluster, &map ) )
+		{
+			NO_MORE_CLUSER();
+			set_entry( fs, &file->location, &file->entry );
+			return FAT_ERROR;
+		}
+
+		if( ( flags & FAT_PREALLOC_ZERO ) && zero_file_clusters( fs, firstCluster, chainClusters, lastCluster ) )
+			result = FAT_ERROR;
+	}
+
+	/* the clusters the file had already hold stale bytes past its size */
+	if( ( flags & FAT_PREALLOC_ZERO ) && !( flags & FAT_PREALLOC_KEEP_SIZE ) && file->entry.fileSize < length && chainClusters )
+	{
+		end		= MIN( length, chainClusters * clusterSize );
+		zeros	= ( char* )calloc( clusterSize, 1 );
+		while( zeros && file->entry.fileSize < end )
+		{
+			if( fat_write( file, file->entry.fileSize, MIN( end - file->entry.fileSize, clusterSize ), zeros ) <= 0 )
+			{
+				result = FAT_ERROR;
+				break;
+			}
+		}
+		free( zeros );
+	}
+
+	if( !( flags & FAT_PREALLOC_KEEP_SIZE ) )
+		file->entry.fileSize = MAX( file->entry.fileSize, length );
+
+	if( set_entry( fs, &file->location, &file->entry ) )
+		result = FAT_ERROR;
+
+	return result;
+}
+
 /******************************************************************************/
 /* Remove file                                                                */
 /******************************************************************************/
 int fat_remove( FAT_NODE* file )
 {
+	FAT_DELAYED_WRITE*	pending;
+	BYTE				first = file->entry.name[0];
+
 	if( file->entry.attribute & ATTR_DIRECTORY )		/* Is directory? */
 		return FAT_ERROR;
 
+	/* a file whose entry can not be written is kept with its data and clusters */
+	refresh_delayed_node( file );
 	file->entry.name[0] = DIR_ENTRY_FREE;
-	set_entry( file->fs, &file->location, &file->entry );
+	if( set_entry( file->fs, &file->location, &file->entry ) )
+	{
+		file->entry.name[0] = first;
+		return FAT_ERROR;
+	}
+
+	/* the delayed data of the file is dropped without being written */
+	if( file->fs->delayed && ( pending = find_delayed_write( file->fs, &file->location ) ) != NULL )
+	{
+		unlink_delayed_write( file->fs, pending );
+		free( pending->data );
+		free( pending );
+	}
+
 	free_cluster_chain( file->fs, GET_FIRST_CLUSTER( file->entry ) );
 
 	return FAT_SUCCESS;
@@ -1402,12 +3194,15 @@ int fat_remove( FAT_NODE* file )
 /******************************************************************************/
 int fat_df( FAT_FILESYSTEM* fs, UINT32* totalSectors, UINT32* usedSectors )
 {
+	wait_free_count( fs );
+
 	if( fs->bpb.totalSectors != 0 )
 		*totalSectors = fs->bpb.totalSectors;
 	else
 		*totalSectors = fs->bpb.totalSectors32;
 
-	*usedSectors = *totalSectors - ( fs->freeClusterList.count * fs->bpb.sectorsPerCluster );
+	/* the clusters reserved for delayed data are counted as used */
+	*usedSectors = *totalSectors - ( ( fs->info32.freeCount - fs->delayedClusters ) * fs->bpb.sectorsPerCluster );
 
 	return FAT_SUCCESS;
 }
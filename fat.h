@@ -14,7 +14,11 @@
 
 #include "common.h"
 #include "disk.h"
-#include "clusterlist.h"
+#include "clusterbitmap.h"
+#include "dentrycache.h"
+#include "dirfilter.h"
+#include "extentcache.h"
+#include "sectorcache.h"
 
 #define FAT12					0
 #define FAT16					1
@@ -43,6 +47,8 @@
 #define SHUT_BIT_MASK32			0x08000000
 #define ERR_BIT_MASK32			0x04000000
 
+#define VOLUME_DIRTY_BIT12		0x01		/* in the reserved byte of the FAT12 boot sector */
+
 #define EOC12					0x0FF8
 #define EOC16					0xFFF8
 #define EOC32					0x0FFFFFF8
@@ -52,6 +58,11 @@
 #define MS_EOC16				0xFFFF
 #define MS_EOC32				0x0FFFFFFF
 
+#define FSINFO_LEAD_SIGNATURE	0x41615252
+#define FSINFO_STRUCT_SIGNATURE	0x61417272
+#define FSINFO_TRAIL_SIGNATURE	0xAA550000
+#define FSINFO_UNKNOWN			0xFFFFFFFF
+
 #define SET_FIRST_CLUSTER( a, b )	{ ( a ).firstClusterHI = ( b ) >> 16; ( a ).firstClusterLO = ( WORD )( ( b ) & 0xFFFF ); }
 #define GET_FIRST_CLUSTER( a )		( ( ( ( DWORD )( a ).firstClusterHI ) << 16 ) | ( a ).firstClusterLO )
 //#define IS_POINT_ROOT_ENTRY( a )	( ( a ).attribute & ATTR_VOLUME_ID )
@@ -152,15 +163,102 @@ typedef struct
 #pragma pack()
 #endif
 
+/* the entry layout of a FAT type. fat_read_superblock() selects the one of the volume, so the
+ * chain walks do not switch on the FAT type for every entry */
+typedef struct
+{
+	DWORD			( *decode_entry )( const BYTE*, SECTOR );
+	void			( *encode_entry )( BYTE*, SECTOR, DWORD );
+	UINT32			nibblesPerEntry;
+	DWORD			mask;
+	DWORD			EOC;				/* the lowest end of chain mark */
+	DWORD			MSEOC;				/* the end of chain mark written */
+} FAT_TYPE_OPERATIONS;
+
+#define FAT_PREALLOC_ZERO		0x01		/* the reserved bytes read as zeros */
+#define FAT_PREALLOC_KEEP_SIZE	0x02		/* reserve clusters past the end of the file */
+
+#define FAT_MOUNT_NO_CACHE		0x01
+#define FAT_MOUNT_WRITE_BACK	0x02		/* keep written sectors in the cache until fat_sync() */
+#define FAT_MOUNT_EAGER_MIRROR	0x04		/* update every FAT copy on each FAT flush, not only on fat_sync() */
+#define FAT_MOUNT_BACKGROUND_SCAN	0x08	/* a clean FAT16/32 volume loads the FAT by a thread after mount */
+#define FAT_MOUNT_DELAYED_ALLOC	0x10		/* appends get clusters when they are flushed, needs FAT_MOUNT_WRITE_BACK */
+
+typedef struct
+{
+	DWORD			flags;
+	UINT32			cacheSectors;		/* 0 selects SECTOR_CACHE_DEFAULT_SIZE */
+	UINT32			dirtySectors;		/* write-back flush threshold, 0 selects half of the cache */
+	UINT32			dirtyExpire;		/* seconds a sector may stay dirty, 0 never expires */
+	UINT32			dentryCount;		/* 0 selects DENTRY_CACHE_DEFAULT_SIZE */
+} FAT_MOUNT_OPTIONS;
+
+typedef struct
+{
+	UINT32	cluster;
+	UINT32	sector;
+	INT32	number;		/* in the sector */
+} FAT_ENTRY_LOCATION;
+
+#define FAT_DIR_SLOTS_COUNT		16
+
+/* Where insert_entry() puts the next entry of a directory. A location past the end of the
+ * directory has the sector number of the sectors of a cluster, or of the root */
+typedef struct
+{
+	SECTOR				parent;			/* first cluster of the directory */
+	BYTE				valid;
+	UINT32				lastUsed;
+	UINT32				freeCount;		/* deleted entries */
+	FAT_ENTRY_LOCATION	nextFree;		/* a deleted entry while freeCount is not 0 */
+	FAT_ENTRY_LOCATION	end;			/* the DIR_ENTRY_NO_MORE entry, or past a full directory */
+} FAT_DIR_SLOTS;
+
+/* options are set by the caller before fat_read_superblock() */
 typedef struct
 {
 	BYTE			FATType;
+	const FAT_TYPE_OPERATIONS*	type;
 	DWORD			FATSize;
 	DWORD			EOCMark;
 	FAT_BPB			bpb;
-	CLUSTER_LIST	freeClusterList;
+	CLUSTER_BITMAP	freeClusters;
 	DISK_OPERATIONS*	disk;
-
+	FAT_MOUNT_OPTIONS	options;
+	SECTOR_CACHE	cache;
+	EXTENT_CACHE	extents;
+	DENTRY_CACHE	dentries;
+	DIR_FILTER_SET	filters;
+	FAT_DIR_SLOTS	slots[FAT_DIR_SLOTS_COUNT];
+	UINT32			slotsClock;
+
+	/* the first FAT is kept in memory, raw for writing back and decoded for lookups */
+	BYTE*			FATBuffer;
+	DWORD*			FATEntries;
+	DWORD			FATEntryCount;
+	BYTE*			FATDirtySectors;	/* one bit per sector of FATBuffer */
+	BYTE*			FATMirrorSectors;	/* sectors written to the first FAT but not to the others */
+	BYTE*			FATChunksLoaded;	/* FAT16/32 may load the FAT on demand, one byte per chunk */
+	UINT32			FATChunkCount;
+	UINT32			FATChunksLeft;
+	BYTE			freeCountKnown;		/* info.freeCount counts the clusters of unloaded chunks too */
+	BYTE			unrecovered;		/* recover_volume() could not walk every directory */
+
+	/* while the scan thread loads the FAT, scanLock guards the chunks and the free cluster bitmap
+	 * and the disk is shared through lockedDisk */
+	BYTE			scanning;
+	BYTE			scanDone;
+	pthread_t		scanThread;
+	pthread_mutex_t	scanLock;
+	DISK_LOCKED		lockedDisk;
+	DISK_OPERATIONS*	scanDisk;
+
+	/* appended data waiting for its clusters, the clusters are reserved from the free count */
+	struct FAT_DELAYED_WRITE*	delayed;
+	UINT32			delayedBytes;
+	UINT32			delayedClusters;
+
+	/* the FSInfo sector of FAT32, its free count is kept up to date for every FAT type */
 	union
 	{
 		FAT_FSINFO	info32;
@@ -177,12 +275,33 @@ typedef struct
 	WORD	year;
 } FAT_FILETIME;
 
+/* Data written past the clusters of a file while FAT_MOUNT_DELAYED_ALLOC is set. The clusters are
+ * allocated as one run when it is flushed, so files appended together do not interleave */
+typedef struct FAT_DELAYED_WRITE
+{
+	FAT_ENTRY_LOCATION	location;		/* of the directory entry of the file */
+	DWORD				start;			/* file offset of data, where the clusters of the file end */
+	DWORD				length;
+	DWORD				size;			/* of data */
+	UINT32				clusters;		/* reserved for data */
+	BYTE*				data;
+
+	struct FAT_DELAYED_WRITE*	next;
+} FAT_DELAYED_WRITE;
+
+/* one run of contiguous clusters of a file transfer, see prepare_cluster_transfer() */
 typedef struct
 {
-	UINT32	cluster;
-	UINT32	sector;
-	INT32	number;		/* in the sector */
-} FAT_ENTRY_LOCATION;
+	DISK_IOVEC	iov[3];
+	int			iovCount;
+	SECTOR		sectorNumber;		/* first sector from the first cluster of the run */
+	UINT32		sectorCount;
+	DWORD		headOffset;			/* where the range starts in the partial first sector */
+	DWORD		headLength;			/* bytes used in the partial first sector */
+	DWORD		tailLength;			/* bytes used in the partial last sector */
+	DWORD		length;
+	char*		buffer;				/* the caller's bytes of this run */
+} CLUSTER_TRANSFER;
 
 typedef struct
 {
@@ -193,9 +312,38 @@ typedef struct
 
 typedef int ( *FAT_NODE_ADD )( void*, FAT_NODE* );
 
+#define FAT_END_OF_DIR			1
+#define FAT_READ_ERROR			-2		/* a lookup could not read the directory, the name may be there */
+
+/* Position of a walk of fat_readdir() with the sector of the next entry. The location is where
+ * the walk is, fat_seekdir() continues from a location kept earlier */
+typedef struct
+{
+	FAT_FILESYSTEM*		fs;
+	FAT_ENTRY_LOCATION	location;		/* of the next entry */
+	BYTE				loaded;			/* sector holds the sector of location */
+	BYTE				end;
+	BYTE				sector[MAX_SECTOR_SIZE];
+} FAT_DIR;
+
+/* state of the directory walk that finds lost clusters after an unclean unmount */
+typedef struct
+{
+	FAT_FILESYSTEM*	fs;
+	BYTE*			reachable;		/* one bit per cluster */
+	SECTOR*			directories;	/* first clusters of the directories left to walk */
+	UINT32			count;
+	UINT32			size;
+} FAT_RECOVERY;
+
 void fat_umount( FAT_FILESYSTEM* fs );
+int fat_sync( FAT_FILESYSTEM* fs );
 int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root );
 int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list );
+int fat_opendir( const FAT_NODE* dir, FAT_DIR* cursor );
+int fat_readdir( FAT_DIR* cursor, FAT_NODE* entry );
+int fat_seekdir( FAT_DIR* cursor, const FAT_ENTRY_LOCATION* location );
+void fat_closedir( FAT_DIR* cursor );
 int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry );
 int fat_rmdir( FAT_NODE* node );
 int fat_lookup( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry );
@@ -203,6 +351,7 @@ int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry );
 int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char* buffer );
 int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer );
 int fat_remove( FAT_NODE* file );
+int fat_preallocate( FAT_NODE* file, unsigned long length, DWORD flags );
 int fat_df( FAT_FILESYSTEM* fs, UINT32* totalSectors, UINT32* usedSectors );
 
 #endif
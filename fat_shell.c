@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
 #include "fat_shell.h"
 
 #define FSOPRS_TO_FATFS( a )		( FAT_FILESYSTEM* )a->pdata
@@ -55,16 +56,14 @@ int my_strnicmp( const char* str1, const char* str2, int length )
 	return 0;
 }
 
-int fat_entry_to_shell_entry( const FAT_NODE* fat_entry, SHELL_ENTRY* shell_entry )
+/* the 8.3 name of an entry as "NAME.EXT", name is zero filled */
+void fat_entry_to_shell_name( const FAT_NODE* fat_entry, BYTE* name )
 {
-	FAT_NODE* entry = ( FAT_NODE* )shell_entry->pdata;
 	BYTE*	str;
 
-	memset( shell_entry, 0, sizeof( SHELL_ENTRY ) );
-
 	if( fat_entry->entry.attribute != ATTR_VOLUME_ID )
 	{
-		str = shell_entry->name;
+		str = name;
 		str = my_strncpy( str, fat_entry->entry.name, 8 );
 		if( fat_entry->entry.name[8] != 0x20 )
 		{
@@ -72,6 +71,15 @@ int fat_entry_to_shell_entry( const FAT_NODE* fat_entry, SHELL_ENTRY* shell_entr
 			str = my_strncpy( str, &fat_entry->entry.name[8], 3 );
 		}
 	}
+}
+
+int fat_entry_to_shell_entry( const FAT_NODE* fat_entry, SHELL_ENTRY* shell_entry )
+{
+	FAT_NODE* entry = ( FAT_NODE* )shell_entry->pdata;
+
+	memset( shell_entry, 0, sizeof( SHELL_ENTRY ) );
+
+	fat_entry_to_shell_name( fat_entry, shell_entry->name );
 
 	if( fat_entry->entry.attribute & ATTR_DIRECTORY ||
 		fat_entry->entry.attribute & ATTR_VOLUME_ID )
@@ -84,6 +92,24 @@ int fat_entry_to_shell_entry( const FAT_NODE* fat_entry, SHELL_ENTRY* shell_entr
 	return FAT_SUCCESS;
 }
 
+int fat_entry_to_dir_entry( const FAT_NODE* fat_entry, SHELL_DIR_ENTRY* dir_entry )
+{
+	memset( dir_entry, 0, sizeof( SHELL_DIR_ENTRY ) );
+
+	fat_entry_to_shell_name( fat_entry, dir_entry->name );
+
+	dir_entry->attribute = fat_entry->entry.attribute;
+	if( fat_entry->entry.attribute & ATTR_DIRECTORY ||
+		fat_entry->entry.attribute & ATTR_VOLUME_ID )
+		dir_entry->isDirectory = 1;
+	else
+		dir_entry->size = fat_entry->entry.fileSize;
+
+	memcpy( dir_entry->pdata, &fat_entry->location, sizeof( FAT_ENTRY_LOCATION ) );
+
+	return FAT_SUCCESS;
+}
+
 int shell_entry_to_fat_entry( const SHELL_ENTRY* shell_entry, FAT_NODE* fat_entry )
 {
 	FAT_NODE* entry = ( FAT_NODE* )shell_entry->pdata;
@@ -137,12 +163,33 @@ int	fs_write( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_EN
 	return fat_write( &FATEntry, offset, length, buffer );
 }
 
+int	fs_preallocate( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, SHELL_ENTRY* entry, unsigned long length, int flags )
+{
+	FAT_NODE	FATEntry;
+	DWORD		FATFlags = 0;
+	int			result;
+
+	if( flags & SHELL_PREALLOC_ZERO )
+		FATFlags |= FAT_PREALLOC_ZERO;
+	if( flags & SHELL_PREALLOC_KEEP_SIZE )
+		FATFlags |= FAT_PREALLOC_KEEP_SIZE;
+
+	shell_entry_to_fat_entry( entry, &FATEntry );
+
+	result = fat_preallocate( &FATEntry, length, FATFlags );
+
+	fat_entry_to_shell_entry( &FATEntry, entry );
+
+	return result;
+}
+
 static SHELL_FILE_OPERATIONS g_file =
 {
 	fs_create,
 	fs_remove,
 	fs_read,
-	fs_write
+	fs_write,
+	fs_preallocate
 };
 
 int fs_stat( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, unsigned int* totalSectors, unsigned int* usedSectors )
@@ -152,16 +199,19 @@ int fs_stat( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, unsigned int* t
 	return fat_df( FSOPRS_TO_FATFS( fsOprs ), totalSectors, usedSectors );
 }
 
+int fs_sync( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs )
+{
+	return fat_sync( FSOPRS_TO_FATFS( fsOprs ) );
+}
+
 int adder( void* list, FAT_NODE* entry )
 {
 	SHELL_ENTRY_LIST*	entryList = ( SHELL_ENTRY_LIST* )list;
-	SHELL_ENTRY			newEntry;
+	SHELL_DIR_ENTRY		newEntry;
 
-	fat_entry_to_shell_entry( entry, &newEntry );
+	fat_entry_to_dir_entry( entry, &newEntry );
 
-	add_entry_list( entryList, &newEntry );
-
-	return FAT_SUCCESS;
+	return add_entry_list( entryList, &newEntry );
 }
 
 int fs_read_dir( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, SHELL_ENTRY_LIST* list )
@@ -172,34 +222,72 @@ int fs_read_dir( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL
 		release_entry_list( list );
 
 	shell_entry_to_fat_entry( parent, &entry );
-	fat_read_dir( &entry, adder, list );
 
-	return FAT_SUCCESS;
+	return fat_read_dir( &entry, adder, list );
 }
 
-int is_exist( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, const char* name )
+int fs_open_dir( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, SHELL_DIR* dir )
+{
+	FAT_NODE	entry;
+
+	dir->pdata = malloc( sizeof( FAT_DIR ) );
+	if( dir->pdata == NULL )
+		return FAT_ERROR;
+
+	shell_entry_to_fat_entry( parent, &entry );
+
+	return fat_opendir( &entry, ( FAT_DIR* )dir->pdata );
+}
+
+int fs_next_entry( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, SHELL_DIR* dir, SHELL_DIR_ENTRY* entry )
 {
-	SHELL_ENTRY_LIST		list;
-	SHELL_ENTRY_LIST_ITEM*	current;
+	FAT_NODE	FATEntry;
+	int			result;
 
-	init_entry_list( &list );
+	result = fat_readdir( ( FAT_DIR* )dir->pdata, &FATEntry );
+	if( result == FAT_END_OF_DIR )
+		return 0;
+	if( result )
+		return FAT_ERROR;
+
+	fat_entry_to_dir_entry( &FATEntry, entry );
+
+	return 1;
+}
 
-	fs_read_dir( disk, fsOprs, parent, &list );
-	current = list.first;
+void fs_close_dir( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, SHELL_DIR* dir )
+{
+	if( dir->pdata == NULL )
+		return;
 
-	while( current )				/* is directory already exist? */
+	fat_closedir( ( FAT_DIR* )dir->pdata );
+	free( dir->pdata );
+	dir->pdata = NULL;
+}
+
+int is_exist( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, const char* name )
+{
+	SHELL_DIR		dir;
+	SHELL_DIR_ENTRY	entry;
+	int				result = FAT_SUCCESS;
+
+	if( fs_open_dir( disk, fsOprs, parent, &dir ) )
 	{
-		if( my_strnicmp( current->entry.name, name, 12 ) == 0 )
+		fs_close_dir( disk, fsOprs, &dir );
+		return FAT_ERROR;
+	}
+
+	while( fs_next_entry( disk, fsOprs, &dir, &entry ) > 0 )	/* is directory already exist? */
+	{
+		if( my_strnicmp( entry.name, name, 12 ) == 0 )
 		{
-			release_entry_list( &list );
-			return FAT_ERROR;		/* the directory is already exist */
+			result = FAT_ERROR;		/* the directory is already exist */
+			break;
 		}
-
-		current = current->next;
 	}
 
-	release_entry_list( &list );
-	return FAT_SUCCESS;
+	fs_close_dir( disk, fsOprs, &dir );
+	return result;
 }
 
 int fs_mkdir( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, const char* name, SHELL_ENTRY* retEntry )
@@ -249,15 +337,75 @@ int fs_lookup( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_E
 static SHELL_FS_OPERATIONS	g_fsOprs =
 {
 	fs_read_dir,
+	fs_open_dir,
+	fs_next_entry,
+	fs_close_dir,
 	fs_stat,
 	fs_mkdir,
 	fs_rmdir,
 	fs_lookup,
+	fs_sync,
 	&g_file,
 	NULL
 };
 
-int fs_mount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, SHELL_ENTRY* root )
+/* comma separated list of
+ * cache=<sectors>	size of the sector cache
+ * dentries=<count>	size of the directory entry cache
+ * nocache			every sector access goes to the disk
+ * bgscan			load the FAT of a clean volume in the background
+ * delalloc			allocate the clusters of appended data when it is written back */
+int parse_mount_options( const char* options, FAT_MOUNT_OPTIONS* mountOptions )
+{
+	char	buffer[256];
+	char*	option;
+	char*	value;
+
+	ZeroMemory( mountOptions, sizeof( FAT_MOUNT_OPTIONS ) );
+
+	if( options == NULL )
+		return FAT_SUCCESS;
+
+	strncpy( buffer, options, sizeof( buffer ) - 1 );
+	buffer[sizeof( buffer ) - 1] = 0;
+
+	for( option = strtok( buffer, "," ); option; option = strtok( NULL, "," ) )
+	{
+		value = strchr( option, '=' );
+		if( value )
+			*value++ = 0;
+
+		if( strcmp( option, "cache" ) == 0 && value )
+			mountOptions->cacheSectors = atoi( value );
+		else if( strcmp( option, "dentries" ) == 0 && value )
+			mountOptions->dentryCount = atoi( value );
+		else if( strcmp( option, "nocache" ) == 0 )
+			mountOptions->flags |= FAT_MOUNT_NO_CACHE;
+		else if( strcmp( option, "writeback" ) == 0 )
+			mountOptions->flags |= FAT_MOUNT_WRITE_BACK;
+		else if( strcmp( option, "bgscan" ) == 0 )
+			mountOptions->flags |= FAT_MOUNT_BACKGROUND_SCAN;
+		else if( strcmp( option, "delalloc" ) == 0 )
+			mountOptions->flags |= FAT_MOUNT_DELAYED_ALLOC;
+		else if( strcmp( option, "mirror" ) == 0 && value && strcmp( value, "eager" ) == 0 )
+			mountOptions->flags |= FAT_MOUNT_EAGER_MIRROR;
+		else if( strcmp( option, "mirror" ) == 0 && value && strcmp( value, "lazy" ) == 0 )
+			mountOptions->flags &= ~FAT_MOUNT_EAGER_MIRROR;
+		else if( strcmp( option, "dirty" ) == 0 && value )
+			mountOptions->dirtySectors = atoi( value );
+		else if( strcmp( option, "expire" ) == 0 && value )
+			mountOptions->dirtyExpire = atoi( value );
+		else
+		{
+			printf( "unknown mount option : %s\n", option );
+			return FAT_ERROR;
+		}
+	}
+
+	return FAT_SUCCESS;
+}
+
+int fs_mount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, SHELL_ENTRY* root, const char* options )
 {
 	FAT_FILESYSTEM* fat;
 	FAT_NODE	fat_entry;
@@ -272,6 +420,13 @@ int fs_mount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, SHELL_ENTRY* r
 	ZeroMemory( fat, sizeof( FAT_FILESYSTEM ) );
 	fat->disk = disk;
 
+	if( parse_mount_options( options, &fat->options ) )
+	{
+		free( fsOprs->pdata );
+		fsOprs->pdata = 0;
+		return -1;
+	}
+
 	result = fat_read_superblock( fat, &fat_entry ); //fat.h --> FAT ý ȣ
 
 	if( result == FAT_SUCCESS )
@@ -298,9 +453,24 @@ int fs_mount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, SHELL_ENTRY* r
 
 void fs_umount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs )
 {
+	FAT_FILESYSTEM*	fat;
+
 	if( fsOprs && fsOprs->pdata )
 	{
-		fat_umount( FSOPRS_TO_FATFS( fsOprs ) );
+		fat = FSOPRS_TO_FATFS( fsOprs );
+
+		/* the sync fat_umount() starts with, done first so the statistics count its flush */
+		if( fat_sync( fat ) )
+			printf( "sync failed\n" );
+
+		printf( "sector cache           : %u hits, %u misses\n", fat->cache.hits, fat->cache.misses );
+		if( fat->cache.writeBack )
+			printf( "write-back flushes     : %u\n", fat->cache.flushes );
+		printf( "extent cache           : %u hits, %u misses\n", fat->extents.hits, fat->extents.misses );
+		printf( "dentry cache           : %u hits, %u misses\n", fat->dentries.hits, fat->dentries.misses );
+		printf( "name filter            : %u negatives, %u false positives\n", fat->filters.negatives, fat->filters.falsePositives );
+
+		fat_umount( fat );
 
 		free( fsOprs->pdata );
 		fsOprs->pdata = 0;
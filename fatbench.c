@@ -0,0 +1,75 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fatbench.c                                                       */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : FAT chain walk micro benchmark                                   */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "fat.h"
+#include "disksim.h"
+
+#define BENCH_HOPS				20000000
+
+int		fat_format( DISK_OPERATIONS* disk, BYTE FATType );
+DWORD	get_fat( FAT_FILESYSTEM* fs, SECTOR cluster );
+int		is_EOC( BYTE FATType, SECTOR clusterNumber );
+SECTOR	alloc_cluster_chain( FAT_FILESYSTEM* fs, SECTOR lastCluster, UINT32 count );
+
+/* walks one long chain of every FAT type until BENCH_HOPS entries were read */
+int bench_chain_walk( BYTE FATType, SECTOR sectors )
+{
+	char				types[][8] = { "FAT12", "FAT16", "FAT32" };
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root;
+	struct timespec		begin, end;
+	SECTOR				first, cluster;
+	UINT32				hops = 0, length = 0;
+	double				elapsed;
+
+	if( disksim_init( sectors, 512, &disk ) || fat_format( &disk, FATType ) )
+		return -1;
+
+	ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+	fs.disk = &disk;
+	if( fat_read_superblock( &fs, &root ) )
+		return -1;
+
+	first = alloc_cluster_chain( &fs, 0, 4000 );
+	for( cluster = first; !is_EOC( fs.FATType, cluster ); cluster = get_fat( &fs, cluster ) )
+		length++;
+
+	clock_gettime( CLOCK_MONOTONIC, &begin );
+	while( hops < BENCH_HOPS )
+	{
+		for( cluster = first; !is_EOC( fs.FATType, cluster ); cluster = get_fat( &fs, cluster ) )
+			hops++;
+	}
+	clock_gettime( CLOCK_MONOTONIC, &end );
+
+	elapsed = ( end.tv_sec - begin.tv_sec ) * 1e9 + ( end.tv_nsec - begin.tv_nsec );
+	printf( "%s chain of %u clusters : %.2f ns/hop\n", types[FATType], length, elapsed / hops );
+
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+int main( void )
+{
+	if( bench_chain_walk( FAT12, 8000 ) || bench_chain_walk( FAT16, 40000 ) || bench_chain_walk( FAT32, 200000 ) )
+	{
+		printf( "benchmark setup failed\n" );
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,425 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fattest.c                                                        */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : File system regression tests                                     */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "fat.h"
+#include "disksim.h"
+
+#define MIN( a, b )			( ( a ) < ( b ) ? ( a ) : ( b ) )
+
+#define CHECK( condition )	if( !( condition ) ) { printf( "%s:%d: %s failed\n", __FILE__, __LINE__, #condition ); return -1; }
+
+int		fat_format( DISK_OPERATIONS* disk, BYTE FATType );
+SECTOR	calc_physical_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber );
+SECTOR	alloc_cluster_chain( FAT_FILESYSTEM* fs, SECTOR lastCluster, UINT32 count );
+int		map_file_chain( FAT_FILESYSTEM* fs, SECTOR firstCluster, UINT32 logical, EXTENT_MAP** ret );
+
+int		g_failWrites;
+SECTOR	g_failWrite;
+SECTOR	g_failRead;
+int		( *g_readSector )( DISK_OPERATIONS*, SECTOR, void* );
+int		( *g_writeSector )( DISK_OPERATIONS*, SECTOR, const void* );
+int		( *g_writeSectorsV )( DISK_OPERATIONS*, SECTOR, const DISK_IOVEC*, int );
+
+/* a disk whose writes fail while g_failWrites is set, or of sector g_failWrite when it is set */
+int failing_write_sectors_v( DISK_OPERATIONS* disk, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	if( g_failWrites || ( g_failWrite && sector <= g_failWrite && g_failWrite < sector + iovCount ) )
+		return -1;
+
+	return g_writeSectorsV( disk, sector, iov, iovCount );
+}
+
+/* a disk whose sector g_failWrite can not be written by a single sector write */
+int failing_write_sector( DISK_OPERATIONS* disk, SECTOR sector, const void* data )
+{
+	if( g_failWrite && sector == g_failWrite )
+		return -1;
+
+	return g_writeSector( disk, sector, data );
+}
+
+/* a disk whose sector g_failRead can not be read while it is set */
+int failing_read_sector( DISK_OPERATIONS* disk, SECTOR sector, void* data )
+{
+	if( g_failRead && sector == g_failRead )
+		return -1;
+
+	return g_readSector( disk, sector, data );
+}
+
+int count_entry( void* list, FAT_NODE* entry )
+{
+	( *( int* )list )++;
+	return FAT_SUCCESS;
+}
+
+/* takes entries until the count it is given runs out */
+int take_entry( void* list, FAT_NODE* entry )
+{
+	return ( *( int* )list )-- > 0 ? FAT_SUCCESS : FAT_ERROR;
+}
+
+int mount_volume( DISK_OPERATIONS* disk, FAT_FILESYSTEM* fs, FAT_NODE* root )
+{
+	ZeroMemory( fs, sizeof( FAT_FILESYSTEM ) );
+	fs->disk = disk;
+
+	return fat_read_superblock( fs, root );
+}
+
+/* A directory whose cluster fills up on a full volume ends with its chain. No end of entries
+ * may be written over its entries */
+int test_full_dir_cluster( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, dir, node;
+	char				name[16];
+	int					i, created = 0, count = 0;
+
+	CHECK( disksim_init( 4096, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 && fs.FATType == FAT12 );
+	CHECK( fat_mkdir( &root, "DIR", &dir ) == 0 );
+
+	/* uses up every free cluster */
+	CHECK( alloc_cluster_chain( &fs, 0, fs.info32.freeCount ) != 0 );
+	CHECK( fs.info32.freeCount == 0 );
+
+	for( i = 0; i < 1000; i++ )
+	{
+		sprintf( name, "F%03d.TXT", i );
+		if( fat_create( &dir, name, &node ) )
+			break;
+		created++;
+	}
+	/* "." and ".." take the first two entries of the cluster */
+	CHECK( created == fs.bpb.sectorsPerCluster * fs.bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY ) - 2 );
+
+	for( i = 0; i < created; i++ )
+	{
+		sprintf( name, "F%03d.TXT", i );
+		CHECK( fat_lookup( &dir, name, &node ) == 0 );
+	}
+
+	fat_umount( &fs );
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+	CHECK( fat_lookup( &root, "DIR", &dir ) == 0 );
+	CHECK( fat_read_dir( &dir, count_entry, &count ) == 0 );
+	CHECK( count == created + 2 );
+
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* Clusters reserved for delayed data are not given to allocations that happen before it is
+ * written, and the data is all on the disk after a sync */
+int test_delayed_reservation( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, file, other, dir;
+	static char			data[4096], check[4096];
+	DWORD				clusterSize, length, offset;
+	int					i;
+
+	CHECK( disksim_init( 4096, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+
+	ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+	fs.disk					= &disk;
+	fs.options.flags		= FAT_MOUNT_WRITE_BACK | FAT_MOUNT_DELAYED_ALLOC;
+	fs.options.cacheSectors	= 8192;
+	fs.options.dirtySectors	= 8000;		/* the delayed data is not flushed before the sync */
+	CHECK( fat_read_superblock( &fs, &root ) == 0 );
+	CHECK( fat_create( &root, "DATA", &file ) == 0 && fat_create( &root, "OTHER", &other ) == 0 );
+
+	/* buffers data for all free clusters but one */
+	clusterSize	= fs.bpb.bytesPerSector * fs.bpb.sectorsPerCluster;
+	length		= ( fs.info32.freeCount - 1 ) * clusterSize;
+	for( offset = 0; offset < length; offset += sizeof( data ) )
+	{
+		for( i = 0; i < sizeof( data ); i++ )
+			data[i] = ( char )( offset / sizeof( data ) + i );
+		CHECK( fat_write( &file, offset, MIN( sizeof( data ), length - offset ), data ) == MIN( sizeof( data ), length - offset ) );
+	}
+	CHECK( fs.delayedClusters == fs.info32.freeCount - 1 );
+
+	CHECK( fat_mkdir( &root, "DIR1", &dir ) == 0 );
+	CHECK( fat_mkdir( &root, "DIR2", &dir ) != 0 );
+	CHECK( fat_preallocate( &other, clusterSize, 0 ) != 0 );
+
+	CHECK( fat_sync( &fs ) == 0 );
+	CHECK( fat_lookup( &root, "DATA", &file ) == 0 && file.entry.fileSize == length );
+	for( offset = 0; offset < length; offset += sizeof( data ) )
+	{
+		for( i = 0; i < sizeof( data ); i++ )
+			data[i] = ( char )( offset / sizeof( data ) + i );
+		CHECK( fat_read( &file, offset, MIN( sizeof( data ), length - offset ), check ) == MIN( sizeof( data ), length - offset ) );
+		CHECK( memcmp( data, check, MIN( sizeof( data ), length - offset ) ) == 0 );
+	}
+
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* A dirty sector that fails to be written stays cached and dirty, no entry is reused over it */
+int test_cache_write_failure( void )
+{
+	DISK_OPERATIONS		disk;
+	SECTOR_CACHE		cache;
+	BYTE				data[512], check[512];
+	SECTOR				i;
+
+	CHECK( disksim_init( 1024, 512, &disk ) == 0 );
+	g_writeSectorsV			= disk.write_sectors_v;
+	disk.write_sectors_v	= failing_write_sectors_v;
+
+	CHECK( init_sector_cache( &cache, &disk, 4 ) == 0 && cache_set_write_back( &cache, 3, 0 ) == 0 );
+
+	/* three dirty sectors and a clean one, the clean one is the least recently used */
+	CHECK( cache_read_sector( &cache, 200, check ) == 0 );
+	for( i = 100; i < 103; i++ )
+	{
+		memset( data, ( int )i, sizeof( data ) );
+		CHECK( cache_write_sector( &cache, i, data, SECTOR_DATA ) == 0 );
+	}
+
+	g_failWrites = 1;
+	CHECK( cache_write_sector( &cache, 103, data, SECTOR_DATA ) != 0 );
+	CHECK( cache_read_sector( &cache, 300, check ) != 0 );
+
+	g_failWrites = 0;
+	CHECK( cache_flush( &cache ) == 0 );
+	for( i = 100; i < 103; i++ )
+	{
+		memset( data, ( int )i, sizeof( data ) );
+		CHECK( disk.read_sector( &disk, i, check ) == 0 && memcmp( data, check, sizeof( data ) ) == 0 );
+	}
+
+	release_sector_cache( &cache );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* a failing callback ends fat_read_dir() with an error */
+int test_read_dir_adder_failure( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, node;
+	char				name[16];
+	int					i, left = 3;
+
+	CHECK( disksim_init( 8000, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+
+	for( i = 0; i < 10; i++ )
+	{
+		sprintf( name, "F%03d.TXT", i );
+		CHECK( fat_create( &root, name, &node ) == 0 );
+	}
+
+	CHECK( fat_read_dir( &root, take_entry, &left ) != 0 );
+	CHECK( left == -1 );
+
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* A recovery that can not read a directory frees nothing and leaves the volume dirty */
+int test_recovery_read_failure( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs, crashed;
+	FAT_NODE			root, dir, file;
+	FAT_BPB				boot;
+	static char			data[8192], check[8192];
+	UINT32				total, used, usedBefore;
+
+	CHECK( disksim_init( 4096, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+	g_readSector		= disk.read_sector;
+	disk.read_sector	= failing_read_sector;
+
+	CHECK( mount_volume( &disk, &crashed, &root ) == 0 && crashed.FATType == FAT12 );
+	CHECK( fat_mkdir( &root, "DIR", &dir ) == 0 && fat_create( &dir, "FILE", &file ) == 0 );
+	memset( data, 0x5A, sizeof( data ) );
+	CHECK( fat_write( &file, 0, sizeof( data ), data ) == sizeof( data ) );
+	CHECK( fat_df( &crashed, &total, &usedBefore ) == 0 );
+
+	/* left without fat_umount() like after a crash, the directory sector can not be read */
+	CHECK( fat_sync( &crashed ) == 0 );
+	g_failRead = calc_physical_sector( &crashed, GET_FIRST_CLUSTER( dir.entry ), 0 );
+
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+	CHECK( fat_df( &fs, &total, &used ) == 0 && used == usedBefore );
+	fat_umount( &fs );
+	CHECK( disk.read_sector( &disk, 0, &boot ) == 0 && ( boot.bs.reserved1 & VOLUME_DIRTY_BIT12 ) );
+
+	g_failRead = 0;
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+	CHECK( fat_lookup( &root, "DIR", &dir ) == 0 && fat_lookup( &dir, "FILE", &file ) == 0 );
+	CHECK( fat_read( &file, 0, sizeof( check ), check ) == sizeof( check ) );
+	CHECK( memcmp( data, check, sizeof( data ) ) == 0 );
+	fat_umount( &fs );
+	CHECK( disk.read_sector( &disk, 0, &boot ) == 0 && !( boot.bs.reserved1 & VOLUME_DIRTY_BIT12 ) );
+
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* metadata is not written when the data written before it failed */
+int test_cache_data_failure( void )
+{
+	DISK_OPERATIONS		disk;
+	SECTOR_CACHE		cache;
+	BYTE				data[512], check[512];
+
+	CHECK( disksim_init( 1024, 512, &disk ) == 0 );
+	g_writeSectorsV			= disk.write_sectors_v;
+	disk.write_sectors_v	= failing_write_sectors_v;
+
+	CHECK( init_sector_cache( &cache, &disk, 8 ) == 0 && cache_set_write_back( &cache, 7, 0 ) == 0 );
+
+	memset( data, 0xDA, sizeof( data ) );
+	CHECK( cache_write_sector( &cache, 500, data, SECTOR_DATA ) == 0 );
+	memset( data, 0x3E, sizeof( data ) );
+	CHECK( cache_write_sector( &cache, 10, data, SECTOR_META ) == 0 );
+
+	g_failWrite = 500;
+	CHECK( cache_flush( &cache ) != 0 );
+	CHECK( disk.read_sector( &disk, 10, check ) == 0 && check[0] != 0x3E );
+
+	g_failWrite = 0;
+	CHECK( cache_flush( &cache ) == 0 );
+	CHECK( disk.read_sector( &disk, 10, check ) == 0 && check[0] == 0x3E );
+	CHECK( disk.read_sector( &disk, 500, check ) == 0 && check[0] == 0xDA );
+
+	release_sector_cache( &cache );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* A lookup that can not read the directory neither misses the name nor builds its filter */
+int test_lookup_read_failure( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, dir, node;
+
+	CHECK( disksim_init( 4096, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+	g_readSector		= disk.read_sector;
+	disk.read_sector	= failing_read_sector;
+
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+	CHECK( fat_mkdir( &root, "DIR", &dir ) == 0 && fat_create( &dir, "FILE", &node ) == 0 );
+	fat_umount( &fs );
+
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 && fat_lookup( &root, "DIR", &dir ) == 0 );
+	g_failRead = calc_physical_sector( &fs, GET_FIRST_CLUSTER( dir.entry ), 0 );
+	CHECK( fat_lookup( &dir, "OTHER", &node ) != 0 );
+	CHECK( fat_create( &dir, "FILE", &node ) != 0 );
+	CHECK( fat_rmdir( &dir ) != 0 );
+
+	g_failRead = 0;
+	CHECK( fat_lookup( &dir, "FILE", &node ) == 0 );
+	CHECK( fat_lookup( &root, "DIR", &dir ) == 0 );
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* A directory entry that fails to be written stays in the dentry cache and keeps its slot */
+int test_entry_write_failure( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, dir, file, node;
+	static char			data[4096], check[4096];
+
+	CHECK( disksim_init( 4096, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+	g_writeSector		= disk.write_sector;
+	disk.write_sector	= failing_write_sector;
+
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+	CHECK( fat_mkdir( &root, "DIR", &dir ) == 0 && fat_create( &dir, "FILE", &file ) == 0 );
+	memset( data, 0x77, sizeof( data ) );
+	CHECK( fat_write( &file, 0, sizeof( data ), data ) == sizeof( data ) );
+	CHECK( fat_lookup( &dir, "FILE", &file ) == 0 );
+
+	g_failWrite = calc_physical_sector( &fs, GET_FIRST_CLUSTER( dir.entry ), 0 );
+	CHECK( fat_remove( &file ) != 0 );
+
+	g_failWrite = 0;
+	CHECK( fat_create( &dir, "NEW", &node ) == 0 );
+	CHECK( fat_lookup( &dir, "FILE", &file ) == 0 && file.entry.fileSize == sizeof( data ) );
+	CHECK( fat_read( &file, 0, sizeof( check ), check ) == sizeof( check ) );
+	CHECK( memcmp( data, check, sizeof( data ) ) == 0 );
+	fat_umount( &fs );
+
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 && fat_lookup( &root, "DIR", &dir ) == 0 );
+	CHECK( fat_lookup( &dir, "FILE", &file ) == 0 && fat_lookup( &dir, "NEW", &node ) == 0 );
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* no chain starts at cluster 0, an empty file is not mapped and hits no unused map */
+int test_empty_chain_map( void )
+{
+	DISK_OPERATIONS		disk;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root;
+	EXTENT_MAP*			map;
+
+	CHECK( disksim_init( 4096, 512, &disk ) == 0 && fat_format( &disk, FAT12 ) == 0 );
+	CHECK( mount_volume( &disk, &fs, &root ) == 0 );
+
+	fs.extents.hits = 0;
+	CHECK( map_file_chain( &fs, 0, 0, &map ) != 0 && map->clusters == 0 );
+	CHECK( map_file_chain( &fs, 0, 0, &map ) != 0 && map->clusters == 0 );
+	CHECK( fs.extents.hits == 0 );
+
+	fat_umount( &fs );
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+int main( void )
+{
+	int		failed = 0;
+
+	failed += test_full_dir_cluster() ? 1 : 0;
+	failed += test_delayed_reservation() ? 1 : 0;
+	failed += test_cache_write_failure() ? 1 : 0;
+	failed += test_cache_data_failure() ? 1 : 0;
+	failed += test_read_dir_adder_failure() ? 1 : 0;
+	failed += test_recovery_read_failure() ? 1 : 0;
+	failed += test_lookup_read_failure() ? 1 : 0;
+	failed += test_entry_write_failure() ? 1 : 0;
+	failed += test_empty_chain_map() ? 1 : 0;
+
+	printf( failed ? "%d test(s) failed\n" : "all tests passed\n", failed );
+
+	return failed ? 1 : 0;
+}
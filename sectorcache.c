@@ -0,0 +1,410 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : sectorcache.c                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Sector buffer cache                                              */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "common.h"
+#include "sectorcache.h"
+
+#define HASH( cache, sector )		( ( sector ) & ( cache )->hashMask )
+#define FLUSH_VECTORS				8
+
+int init_sector_cache( SECTOR_CACHE* cache, DISK_OPERATIONS* disk, UINT32 count )
+{
+	UINT32	i, hashSize = 1;
+
+	if( cache == NULL || disk == NULL )
+		return FAT_ERROR;
+
+	ZeroMemory( cache, sizeof( SECTOR_CACHE ) );
+	cache->disk = disk;
+
+	if( count == 0 )
+		return FAT_SUCCESS;
+
+	while( hashSize < count )
+		hashSize <<= 1;
+
+	cache->entries	= ( SECTOR_CACHE_ENTRY* )calloc( count, sizeof( SECTOR_CACHE_ENTRY ) );
+	cache->hash		= ( SECTOR_CACHE_ENTRY** )calloc( hashSize, sizeof( SECTOR_CACHE_ENTRY* ) );
+	cache->buffers	= ( BYTE* )malloc( ( size_t )count * disk->bytesPerSector );
+	if( cache->entries == NULL || cache->hash == NULL || cache->buffers == NULL )
+	{
+		release_sector_cache( cache );
+		return FAT_ERROR;
+	}
+
+	cache->count	= count;
+	cache->hashMask	= hashSize - 1;
+
+	for( i = 0; i < count; i++ )
+	{
+		cache->entries[i].data	= &cache->buffers[( size_t )i * disk->bytesPerSector];
+		cache->entries[i].prev	= ( i > 0 ? &cache->entries[i - 1] : NULL );
+		cache->entries[i].next	= ( i < count - 1 ? &cache->entries[i + 1] : NULL );
+	}
+	cache->first	= &cache->entries[0];
+	cache->last		= &cache->entries[count - 1];
+
+	return FAT_SUCCESS;
+}
+
+void release_sector_cache( SECTOR_CACHE* cache )
+{
+	if( cache == NULL )
+		return;
+
+	free( cache->entries );
+	free( cache->hash );
+	free( cache->buffers );
+	free( cache->flushList );
+	free( cache->flushVectors );
+	free( cache->flushRequests );
+
+	cache->entries	= NULL;
+	cache->hash		= NULL;
+	cache->buffers	= NULL;
+	cache->flushList		= NULL;
+	cache->flushVectors		= NULL;
+	cache->flushRequests	= NULL;
+	cache->writeBack		= 0;
+	cache->dirtyCount		= 0;
+	cache->first	= cache->last = NULL;
+	cache->count	= 0;
+}
+
+SECTOR_CACHE_ENTRY* find_cache_entry( SECTOR_CACHE* cache, SECTOR sector )
+{
+	SECTOR_CACHE_ENTRY*	entry;
+
+	for( entry = cache->hash[HASH( cache, sector )]; entry; entry = entry->hashNext )
+	{
+		if( entry->sector == sector )
+			return entry;
+	}
+
+	return NULL;
+}
+
+void unhash_cache_entry( SECTOR_CACHE* cache, SECTOR_CACHE_ENTRY* entry )
+{
+	SECTOR_CACHE_ENTRY**	link = &cache->hash[HASH( cache, entry->sector )];
+
+	while( *link != entry )
+		link = &( *link )->hashNext;
+
+	*link = entry->hashNext;
+	entry->hashNext = NULL;
+	entry->valid = 0;
+
+	if( entry->dirty )
+	{
+		entry->dirty = 0;
+		cache->dirtyCount--;
+	}
+
+	/* an unused entry is the first one to be reused */
+	if( cache->last != entry )
+	{
+		if( entry->prev )
+			entry->prev->next = entry->next;
+		else
+			cache->first = entry->next;
+		entry->next->prev = entry->prev;
+
+		entry->prev = cache->last;
+		entry->next = NULL;
+		cache->last->next = entry;
+		cache->last = entry;
+	}
+}
+
+/* moves the entry to the head of the LRU list */
+void touch_cache_entry( SECTOR_CACHE* cache, SECTOR_CACHE_ENTRY* entry )
+{
+	if( cache->first == entry )
+		return;
+
+	entry->prev->next = entry->next;
+	if( entry->next )
+		entry->next->prev = entry->prev;
+	else
+		cache->last = entry->prev;
+
+	entry->prev = NULL;
+	entry->next = cache->first;
+	cache->first->prev = entry;
+	cache->first = entry;
+}
+
+/* Reuses the least recently used entry for the sector, a dirty one is written out first. When
+ * the write fails the least recently used clean entry is reused, NULL when all are dirty */
+SECTOR_CACHE_ENTRY* replace_cache_entry( SECTOR_CACHE* cache, SECTOR sector )
+{
+	SECTOR_CACHE_ENTRY*	entry = cache->last;
+
+	/* flushing everything keeps data ahead of metadata, which writing just the victim would not */
+	if( entry->dirty && cache_flush( cache ) )
+	{
+		/* the sectors that failed stay dirty for the next flush */
+		while( entry && entry->dirty )
+			entry = entry->prev;
+		if( entry == NULL )
+			return NULL;
+	}
+
+	if( entry->valid )
+		unhash_cache_entry( cache, entry );
+
+	entry->sector	= sector;
+	entry->valid	= 1;
+	entry->hashNext	= cache->hash[HASH( cache, sector )];
+	cache->hash[HASH( cache, sector )] = entry;
+
+	touch_cache_entry( cache, entry );
+
+	return entry;
+}
+
+int cache_read_sector( SECTOR_CACHE* cache, SECTOR sector, void* data )
+{
+	SECTOR_CACHE_ENTRY*	entry;
+
+	if( cache->count == 0 )
+		return cache->disk->read_sector( cache->disk, sector, data );
+
+	entry = find_cache_entry( cache, sector );
+	if( entry )
+	{
+		cache->hits++;
+		touch_cache_entry( cache, entry );
+	}
+	else
+	{
+		cache->misses++;
+		entry = replace_cache_entry( cache, sector );
+		if( entry == NULL )
+			return FAT_ERROR;
+
+		if( cache->disk->read_sector( cache->disk, sector, entry->data ) )
+		{
+			unhash_cache_entry( cache, entry );
+			return FAT_ERROR;
+		}
+	}
+
+	memcpy( data, entry->data, cache->disk->bytesPerSector );
+
+	return FAT_SUCCESS;
+}
+
+/* writes through to the disk keeping the cached copy, or only marks the copy dirty in write-back mode */
+int cache_write_sector( SECTOR_CACHE* cache, SECTOR sector, const void* data, BYTE kind )
+{
+	SECTOR_CACHE_ENTRY*	entry;
+
+	if( cache->count == 0 )
+		return cache->disk->write_sector( cache->disk, sector, data );
+
+	entry = find_cache_entry( cache, sector );
+	if( entry )
+		touch_cache_entry( cache, entry );
+	else
+	{
+		entry = replace_cache_entry( cache, sector );
+		if( entry == NULL )
+			return FAT_ERROR;
+	}
+
+	memcpy( entry->data, data, cache->disk->bytesPerSector );
+	entry->kind = kind;
+
+	if( cache->writeBack )
+	{
+		if( !entry->dirty )
+		{
+			if( cache->dirtyCount++ == 0 )
+				cache->oldestDirty = time( NULL );
+			entry->dirty = 1;
+		}
+
+		if( cache->dirtyCount > cache->dirtyLimit ||
+			( cache->dirtyExpire && time( NULL ) - cache->oldestDirty >= cache->dirtyExpire ) )
+			return cache_flush( cache );
+
+		return FAT_SUCCESS;
+	}
+
+	if( cache->disk->write_sector( cache->disk, sector, data ) )
+	{
+		unhash_cache_entry( cache, entry );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* drops cached copies of sectors that were transferred around the cache */
+void cache_invalidate_sectors( SECTOR_CACHE* cache, SECTOR sector, UINT32 count )
+{
+	SECTOR_CACHE_ENTRY*	entry;
+	UINT32				i;
+
+	if( cache->count == 0 )
+		return;
+
+	for( i = 0; i < count; i++ )
+	{
+		entry = find_cache_entry( cache, sector + i );
+		if( entry )
+			unhash_cache_entry( cache, entry );
+	}
+}
+
+/* dirtyLimit 0 selects half of the cache */
+int cache_set_write_back( SECTOR_CACHE* cache, UINT32 dirtyLimit, UINT32 dirtyExpire )
+{
+	if( cache->count == 0 )
+		return FAT_ERROR;
+
+	cache->flushList		= ( SECTOR_CACHE_ENTRY** )malloc( cache->count * sizeof( SECTOR_CACHE_ENTRY* ) );
+	cache->flushVectors		= ( DISK_IOVEC* )malloc( cache->count * sizeof( DISK_IOVEC ) );
+	cache->flushRequests	= ( DISK_REQUEST* )malloc( cache->count * sizeof( DISK_REQUEST ) );
+	if( cache->flushList == NULL || cache->flushVectors == NULL || cache->flushRequests == NULL )
+		return FAT_ERROR;
+
+	if( dirtyLimit == 0 || dirtyLimit >= cache->count )
+		dirtyLimit = cache->count / 2;
+
+	cache->writeBack	= 1;
+	cache->dirtyLimit	= dirtyLimit;
+	cache->dirtyExpire	= dirtyExpire;
+
+	return FAT_SUCCESS;
+}
+
+int compare_flush_entries( const void* a, const void* b )
+{
+	const SECTOR_CACHE_ENTRY*	entry1 = *( const SECTOR_CACHE_ENTRY** )a;
+	const SECTOR_CACHE_ENTRY*	entry2 = *( const SECTOR_CACHE_ENTRY** )b;
+
+	if( entry1->kind != entry2->kind )
+		return entry1->kind - entry2->kind;
+
+	return ( entry1->sector > entry2->sector ) - ( entry1->sector < entry2->sector );
+}
+
+/* Writes every dirty sector. Data sectors are written and completed before metadata sectors are
+ * issued, each class in ascending sector order with adjacent sectors merged into one request */
+int cache_flush( SECTOR_CACHE* cache )
+{
+	SECTOR_CACHE_ENTRY*	entry;
+	DISK_REQUEST*		request = NULL;
+	UINT32				i, listCount = 0, requestCount = 0, first = 0, metaFirst = 0;
+	int					result = FAT_SUCCESS;
+
+	if( cache->dirtyCount == 0 )
+		return FAT_SUCCESS;
+
+	for( i = 0; i < cache->count; i++ )
+	{
+		if( cache->entries[i].dirty )
+			cache->flushList[listCount++] = &cache->entries[i];
+	}
+
+	qsort( cache->flushList, listCount, sizeof( SECTOR_CACHE_ENTRY* ), compare_flush_entries );
+
+	for( i = 0; i < listCount; i++ )
+	{
+		entry = cache->flushList[i];
+
+		if( request && entry->kind == cache->flushList[i - 1]->kind &&
+			entry->sector == cache->flushList[i - 1]->sector + 1 && request->iovCount < FLUSH_VECTORS )
+			request->iovCount++;
+		else
+		{
+			/* the data class sorts first, the metadata class starts at a change of kind */
+			if( request && entry->kind != cache->flushList[i - 1]->kind )
+				metaFirst = requestCount;
+
+			request = &cache->flushRequests[requestCount++];
+			request->write		= 1;
+			request->sector		= entry->sector;
+			request->iov		= &cache->flushVectors[i];
+			request->iovCount	= 1;
+		}
+
+		cache->flushVectors[i].buffer	= entry->data;
+		cache->flushVectors[i].count	= 1;
+	}
+
+	/* without a change of kind every request is of the class of the first one */
+	if( metaFirst == 0 && listCount && cache->flushList[0]->kind == SECTOR_DATA )
+		metaFirst = requestCount;
+
+	/* The metadata class starts only after all data requests have completed. When data failed
+	 * to be written no metadata is, it could point at the data that is not on the disk */
+	if( disk_transfer_requests( cache->disk, cache->flushRequests, metaFirst ) )
+		result = FAT_ERROR;
+
+	if( result == FAT_SUCCESS )
+	{
+		if( disk_transfer_requests( cache->disk, &cache->flushRequests[metaFirst], requestCount - metaFirst ) )
+			result = FAT_ERROR;
+	}
+	else
+	{
+		for( i = metaFirst; i < requestCount; i++ )
+			cache->flushRequests[i].result = DISK_REQUEST_PENDING;
+	}
+
+	/* sectors that failed to be written stay dirty */
+	for( i = 0; i < listCount; i++ )
+		cache->flushList[i]->dirty = 0;
+	cache->dirtyCount = 0;
+
+	for( i = 0; i < requestCount; i++ )
+	{
+		if( cache->flushRequests[i].result == 0 )
+			continue;
+
+		first = ( UINT32 )( cache->flushRequests[i].iov - cache->flushVectors );
+		for( listCount = 0; listCount < ( UINT32 )cache->flushRequests[i].iovCount; listCount++ )
+		{
+			cache->flushList[first + listCount]->dirty = 1;
+			cache->dirtyCount++;
+		}
+	}
+
+	cache->oldestDirty = time( NULL );
+	cache->flushes++;
+
+	return result;
+}
+
+/* copies dirty cached sectors over a range that was just read from the disk */
+void cache_overlay_sectors( SECTOR_CACHE* cache, SECTOR sector, const DISK_IOVEC* iov, int iovCount )
+{
+	SECTOR_CACHE_ENTRY*	entry;
+	UINT32				i;
+	int					j;
+
+	if( cache->dirtyCount == 0 )
+		return;
+
+	for( j = 0; j < iovCount; j++ )
+	{
+		for( i = 0; i < iov[j].count; i++, sector++ )
+		{
+			entry = find_cache_entry( cache, sector );
+			if( entry && entry->dirty )
+				memcpy( ( BYTE* )iov[j].buffer + ( size_t )i * cache->disk->bytesPerSector, entry->data, cache->disk->bytesPerSector );
+		}
+	}
+}
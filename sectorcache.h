@@ -0,0 +1,74 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : sectorcache.h                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Sector buffer cache header                                       */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _SECTORCACHE_H_
+#define _SECTORCACHE_H_
+
+#include <time.h>
+#include "common.h"
+#include "disk.h"
+
+#define SECTOR_CACHE_DEFAULT_SIZE	256
+
+/* dirty sectors are flushed in this order, file data before the metadata that points to it */
+#define SECTOR_DATA					0
+#define SECTOR_META					1
+
+typedef struct SECTOR_CACHE_ENTRY
+{
+	SECTOR			sector;
+	BYTE			valid;
+	BYTE			dirty;
+	BYTE			kind;			/* SECTOR_DATA or SECTOR_META */
+	BYTE*			data;
+
+	struct SECTOR_CACHE_ENTRY*	hashNext;
+	struct SECTOR_CACHE_ENTRY*	prev;		/* LRU list, the most recently used one is first */
+	struct SECTOR_CACHE_ENTRY*	next;
+} SECTOR_CACHE_ENTRY;
+
+typedef struct
+{
+	DISK_OPERATIONS*		disk;
+	UINT32					count;			/* 0 passes every access to the disk */
+	UINT32					hashMask;
+
+	SECTOR_CACHE_ENTRY*		entries;
+	SECTOR_CACHE_ENTRY**	hash;
+	SECTOR_CACHE_ENTRY*		first;
+	SECTOR_CACHE_ENTRY*		last;
+	BYTE*					buffers;
+
+	/* write-back state, dirty sectors are written by cache_flush() */
+	BYTE					writeBack;
+	UINT32					dirtyCount;
+	UINT32					dirtyLimit;		/* flush when more sectors than this are dirty */
+	UINT32					dirtyExpire;	/* flush when a sector is dirty for this many seconds, 0 never */
+	time_t					oldestDirty;
+	SECTOR_CACHE_ENTRY**	flushList;
+	DISK_IOVEC*				flushVectors;
+	DISK_REQUEST*			flushRequests;
+
+	UINT32					hits;
+	UINT32					misses;
+	UINT32					flushes;
+} SECTOR_CACHE;
+
+int		init_sector_cache( SECTOR_CACHE*, DISK_OPERATIONS*, UINT32 );
+int		cache_read_sector( SECTOR_CACHE*, SECTOR, void* );
+int		cache_write_sector( SECTOR_CACHE*, SECTOR, const void*, BYTE );
+int		cache_set_write_back( SECTOR_CACHE*, UINT32, UINT32 );
+int		cache_flush( SECTOR_CACHE* );
+void	cache_invalidate_sectors( SECTOR_CACHE*, SECTOR, UINT32 );
+void	cache_overlay_sectors( SECTOR_CACHE*, SECTOR, const DISK_IOVEC*, int );
+void	release_sector_cache( SECTOR_CACHE* );
+
+#endif
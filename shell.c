@@ -11,9 +11,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <memory.h>
 #include "shell.h"
 #include "disksim.h"
+#include "diskuring.h"
 
 #define SECTOR_SIZE				512
 #define NUMBER_OF_SECTORS		4096
@@ -30,6 +32,7 @@ typedef struct
 
 extern void shell_register_filesystem( SHELL_FILESYSTEM* );
 
+int open_disk( int argc, char* argv[] );
 void do_shell( void );
 void unknown_command( void );
 int seperate_string( char* buf, char* ptrs[] );
@@ -44,10 +47,12 @@ int shell_cmd_rm( int argc, char* argv[] );
 int shell_cmd_ls( int argc, char* argv[] );
 int shell_cmd_format( int argc, char* argv[] );
 int shell_cmd_df( int argc, char* argv[] );
+int shell_cmd_sync( int argc, char* argv[] );
 int shell_cmd_mkdir( int argc, char* argv[] );
 int shell_cmd_rmdir( int argc, char* argv[] );
 int shell_cmd_mkdirst( int argc, char* argv[] );
 int shell_cmd_cat( int argc, char* argv[] );
+int shell_cmd_prealloc( int argc, char* argv[] );
 
 static COMMAND g_commands[] =
 {
@@ -63,10 +68,12 @@ static COMMAND g_commands[] =
 	{ "dir",	shell_cmd_ls,		COND_MOUNT	},
 	{ "format",	shell_cmd_format,	COND_UMOUNT	},
 	{ "df",		shell_cmd_df,		COND_MOUNT	},
+	{ "sync",	shell_cmd_sync,		COND_MOUNT	},
 	{ "mkdir",	shell_cmd_mkdir,	COND_MOUNT	},
 	{ "rmdir",	shell_cmd_rmdir,	COND_MOUNT	},
 	{ "mkdirst",shell_cmd_mkdirst,	COND_MOUNT	},
-	{ "cat",	shell_cmd_cat,		COND_MOUNT	}
+	{ "cat",	shell_cmd_cat,		COND_MOUNT	},
+	{ "prealloc",shell_cmd_prealloc,COND_MOUNT	}
 };
 
 static SHELL_FILESYSTEM		g_fs;
@@ -74,13 +81,14 @@ static SHELL_FS_OPERATIONS	g_fsOprs;
 static SHELL_ENTRY			g_rootDir;
 static SHELL_ENTRY			g_currentDir;
 static DISK_OPERATIONS		g_disk;
+static void					( *g_diskUninit )( DISK_OPERATIONS* ) = disksim_uninit;
 
 int g_commandsCount = sizeof( g_commands ) / sizeof( COMMAND );
 int g_isMounted;
 
 int main( int argc, char* argv[] )
 {
-	if( disksim_init( NUMBER_OF_SECTORS, SECTOR_SIZE, &g_disk ) < 0 ) //disksim ʱȭ
+	if( open_disk( argc - 1, argv + 1 ) < 0 ) //disksim ʱȭ
 	{
 		printf( "disk simulator initialization has been failed\n" );
 		return -1;
@@ -93,6 +101,57 @@ int main( int argc, char* argv[] )
 	return 0;
 }
 
+/* [-d memory|mmap|file|direct|uring] [image file]
+ * Without an image the disk lives only in memory, an image is mapped unless another type is given */
+int open_disk( int argc, char* argv[] )
+{
+	char*	type = NULL;
+	char*	image = NULL;
+	int		i, result;
+
+	for( i = 0; i < argc; i++ )
+	{
+		if( strcmp( argv[i], "-d" ) == 0 && i + 1 < argc )
+			type = argv[++i];
+		else
+			image = argv[i];
+	}
+
+	if( type == NULL )
+		type = ( image ? "mmap" : "memory" );
+
+	if( strcmp( type, "memory" ) && image == NULL )
+	{
+		printf( "%s disk needs an image file\n", type );
+		return -1;
+	}
+
+	if( g_disk.pdata )
+		g_diskUninit( &g_disk );
+	g_diskUninit = disksim_uninit;
+
+	if( strcmp( type, "memory" ) == 0 )
+		result = disksim_init( NUMBER_OF_SECTORS, SECTOR_SIZE, &g_disk );
+	else if( strcmp( type, "mmap" ) == 0 )
+		result = disksim_init_file( image, NUMBER_OF_SECTORS, SECTOR_SIZE, &g_disk );
+	else if( strcmp( type, "file" ) == 0 )
+		result = disksim_init_fd( image, NUMBER_OF_SECTORS, SECTOR_SIZE, 0, &g_disk );
+	else if( strcmp( type, "direct" ) == 0 )
+		result = disksim_init_fd( image, NUMBER_OF_SECTORS, SECTOR_SIZE, DISKSIM_DIRECT, &g_disk );
+	else if( strcmp( type, "uring" ) == 0 )
+	{
+		result = diskuring_init( image, NUMBER_OF_SECTORS, SECTOR_SIZE, DISKURING_QUEUE_DEPTH, &g_disk );
+		g_diskUninit = diskuring_uninit;
+	}
+	else
+	{
+		printf( "unknown disk type : %s\n", type );
+		return -1;
+	}
+
+	return result;
+}
+
 int check_conditions( int conditions )
 {
 	if( conditions & COND_MOUNT && !g_isMounted )
@@ -229,7 +288,7 @@ int shell_cmd_cd( int argc, char* argv[] )
 
 int shell_cmd_exit( int argc, char* argv[] )
 {
-	disksim_uninit( &g_disk );
+	g_diskUninit( &g_disk );
 	_exit( 0 );
 
 	return 0;
@@ -237,7 +296,9 @@ int shell_cmd_exit( int argc, char* argv[] )
 
 int shell_cmd_mount( int argc, char* argv[] )
 {
-	int result;
+	int		result, i, diskArgc = 0;
+	char*	diskArgv[100];
+	char*	options = NULL;
 
 	if( g_fs.mount == NULL )
 	{
@@ -245,7 +306,22 @@ int shell_cmd_mount( int argc, char* argv[] )
 		return 0;
 	}
 
-	result = g_fs.mount( &g_disk, &g_fsOprs, &g_rootDir ); //fs.mount --> fat_shell.h
+	for( i = 1; i < argc; i++ )
+	{
+		if( strcmp( argv[i], "-o" ) == 0 && i + 1 < argc )
+			options = argv[++i];
+		else
+			diskArgv[diskArgc++] = argv[i];
+	}
+
+	/* mount [-o options] [-d memory|mmap|file|direct|uring] [image file] : switch the disk before mounting */
+	if( diskArgc > 0 && open_disk( diskArgc, diskArgv ) < 0 )
+	{
+		printf( "usage : %s [-o options] [-d memory|mmap|file|direct|uring] [image]\n", argv[0] );
+		return -1;
+	}
+
+	result = g_fs.mount( &g_disk, &g_fsOprs, &g_rootDir, options ); //fs.mount --> fat_shell.h
 	g_currentDir = g_rootDir; //  丮 = Ʈ 丮
 
 	if( result < 0 )
@@ -352,8 +428,9 @@ int shell_cmd_rm( int argc, char* argv[] )
 
 int shell_cmd_ls( int argc, char* argv[] )
 {
-	SHELL_ENTRY_LIST		list;
-	SHELL_ENTRY_LIST_ITEM*	current;
+	SHELL_DIR		dir;
+	SHELL_DIR_ENTRY	entry;
+	int				result;
 
 	if( argc > 2 )
 	{
@@ -361,25 +438,29 @@ int shell_cmd_ls( int argc, char* argv[] )
 		return 0;
 	}
 
-	init_entry_list( &list );
-	if( g_fsOprs.read_dir( &g_disk, &g_fsOprs, &g_currentDir, &list ) )
+	/* the entries are printed as they are read, a directory of any size takes one entry */
+	if( g_fsOprs.open_dir( &g_disk, &g_fsOprs, &g_currentDir, &dir ) )
 	{
+		g_fsOprs.close_dir( &g_disk, &g_fsOprs, &dir );
 		printf( "Failed to read_dir\n" );
 		return -1;
 	}
 
-	current = list.first;
-
 	printf( "[File names] [D] [File sizes]\n" );
-	while( current )
+	while( ( result = g_fsOprs.next_entry( &g_disk, &g_fsOprs, &dir, &entry ) ) > 0 )
 	{
 		printf( "%-12s  %1d  %12d\n",
-				current->entry.name, current->entry.isDirectory, current->entry.size );
-		current = current->next;
+				entry.name, entry.isDirectory, entry.size );
 	}
 	printf( "\n" );
 
-	release_entry_list( &list );
+	g_fsOprs.close_dir( &g_disk, &g_fsOprs, &dir );
+
+	if( result < 0 )
+	{
+		printf( "Failed to read_dir\n" );
+		return -1;
+	}
 	return 0;
 }
 
@@ -423,6 +504,17 @@ int shell_cmd_df( int argc, char* argv[] )
 	return 0;
 }
 
+int shell_cmd_sync( int argc, char* argv[] )
+{
+	if( g_fsOprs.sync == NULL )
+		return 0;
+
+	if( g_fsOprs.sync( &g_disk, &g_fsOprs ) )
+		printf( "sync failed\n" );
+
+	return 0;
+}
+
 int shell_cmd_mkdir( int argc, char* argv[] )
 {
 	SHELL_ENTRY	entry;
@@ -522,3 +614,54 @@ int shell_cmd_cat( int argc, char* argv[] )
 	}
 	printf( "\n" );
 }
+
+int shell_cmd_prealloc( int argc, char* argv[] )
+{
+	SHELL_ENTRY	entry;
+	int			flags = 0;
+	unsigned long	size;
+	char*		end;
+	int			i;
+
+	for( i = 1; i < argc && argv[i][0] == '-'; i++ )
+	{
+		if( strcmp( argv[i], "-z" ) == 0 )
+			flags |= SHELL_PREALLOC_ZERO;
+		else if( strcmp( argv[i], "-k" ) == 0 )
+			flags |= SHELL_PREALLOC_KEEP_SIZE;
+		else
+			break;
+	}
+
+	if( argc - i != 2 )
+	{
+		printf( "usage : %s [-z] [-k] [file] [size]\n", argv[0] );
+		return 0;
+	}
+
+	/* the whole argument is a number of bytes, strtoul() would take a negative one */
+	errno = 0;
+	size = strtoul( argv[i + 1], &end, 10 );
+	if( argv[i + 1][0] < '0' || argv[i + 1][0] > '9' || *end != 0 || errno == ERANGE )
+	{
+		printf( "invalid size : %s\n", argv[i + 1] );
+		return -1;
+	}
+
+	if( g_fsOprs.lookup( &g_disk, &g_fsOprs, &g_currentDir, &entry, argv[i] ) )
+	{
+		if( g_fsOprs.fileOprs->create( &g_disk, &g_fsOprs, &g_currentDir, argv[i], &entry ) )
+		{
+			printf( "create failed\n" );
+			return -1;
+		}
+	}
+
+	if( g_fsOprs.fileOprs->preallocate( &g_disk, &g_fsOprs, &g_currentDir, &entry, size, flags ) )
+	{
+		printf( "preallocate failed\n" );
+		return -1;
+	}
+
+	return 0;
+}
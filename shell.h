@@ -49,28 +49,64 @@ typedef struct SHELL_ENTRY
 	char				pdata[1024];
 } SHELL_ENTRY;
 
+/* An entry of a directory listing, a small part of SHELL_ENTRY. The private data is only where
+ * the file system keeps the entry, SHELL_FS_OPERATIONS.lookup gives the whole entry */
+typedef struct
+{
+	unsigned char		name[13];		/* short name */
+	unsigned char		isDirectory;
+	unsigned char		attribute;
+	unsigned int		size;
+
+	char				pdata[12];
+} SHELL_DIR_ENTRY;
+
 typedef struct SHELL_ENTRY_LIST_ITEM
 {
-	struct SHELL_ENTRY				entry;
+	SHELL_DIR_ENTRY					entry;
 	struct SHELL_ENTRY_LIST_ITEM*	next;
 } SHELL_ENTRY_LIST_ITEM;
 
+#define SHELL_ENTRY_BLOCK_ITEMS		256
+
+/* the items of a list are cut from blocks, which are freed together with the list */
+typedef struct SHELL_ENTRY_BLOCK
+{
+	struct SHELL_ENTRY_BLOCK*		next;
+	unsigned int					used;
+	SHELL_ENTRY_LIST_ITEM			items[SHELL_ENTRY_BLOCK_ITEMS];
+} SHELL_ENTRY_BLOCK;
+
 typedef struct
 {
 	unsigned int					count;
 	SHELL_ENTRY_LIST_ITEM*			first;
 	SHELL_ENTRY_LIST_ITEM*			last;
+	SHELL_ENTRY_BLOCK*				blocks;		/* the newest one first */
 } SHELL_ENTRY_LIST;
 
 struct SHELL_FILE_OPERATIONS;
 
+/* an open directory of SHELL_FS_OPERATIONS.open_dir, pdata is the position of the file system */
+typedef struct
+{
+	void*	pdata;
+} SHELL_DIR;
+
+#define SHELL_PREALLOC_ZERO			0x01
+#define SHELL_PREALLOC_KEEP_SIZE	0x02
+
 typedef struct SHELL_FS_OPERATIONS
 {
 	int	( *read_dir )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, SHELL_ENTRY_LIST* );
+	int	( *open_dir )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, SHELL_DIR* );
+	int	( *next_entry )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, SHELL_DIR*, SHELL_DIR_ENTRY* );	/* 1 with an entry, 0 at the end */
+	void	( *close_dir )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, SHELL_DIR* );
 	int	( *stat )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, unsigned int*, unsigned int* );
 	int ( *mkdir )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, const char*, SHELL_ENTRY* );
 	int ( *rmdir )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, const char* );
 	int ( *lookup )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, SHELL_ENTRY*, const char* );
+	int	( *sync )( DISK_OPERATIONS*, struct SHELL_FS_OPERATIONS* );
 
 	struct SHELL_FILE_OPERATIONS*	fileOprs;
 	void*	pdata;
@@ -82,18 +118,19 @@ typedef struct SHELL_FILE_OPERATIONS
 	int ( *remove )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, const char* );
 	int	( *read )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, SHELL_ENTRY*, unsigned long, unsigned long, char* );
 	int	( *write )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, SHELL_ENTRY*, unsigned long, unsigned long, const char* );
+	int	( *preallocate )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS*, const SHELL_ENTRY*, SHELL_ENTRY*, unsigned long, int );
 } SHELL_FILE_OPERATIONS;
 
 typedef struct
 {
 	char*	name;
-	int		( *mount )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS*, SHELL_ENTRY* );
+	int		( *mount )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS*, SHELL_ENTRY*, const char* );
 	void	( *umount )( DISK_OPERATIONS*, SHELL_FS_OPERATIONS* );
 	int		( *format )( DISK_OPERATIONS*, void* );
 } SHELL_FILESYSTEM;
 
 int		init_entry_list( SHELL_ENTRY_LIST* list );
-int		add_entry_list( SHELL_ENTRY_LIST*, struct SHELL_ENTRY* );
+int		add_entry_list( SHELL_ENTRY_LIST*, const SHELL_DIR_ENTRY* );
 void	release_entry_list( SHELL_ENTRY_LIST* );
 
 #endif